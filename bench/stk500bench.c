@@ -0,0 +1,352 @@
+/*
+Title:     Simulator benchmark for the STK500v2 bootloader
+Hardware:  simavr
+License:   BSD-3-Clause
+
+Description:
+		Runs a bootloader ELF in simavr and drives it with a scripted STK500v2 host
+		over UART0. Reports the cycles each command type takes, the time from reset
+		to the first answer byte and to appStart(), and the program and verify rates.
+
+		The host sends every frame back to back at the modelled baudrate and never
+		waits itself, so any time spent beyond the line time of the command and its
+		answer is bootloader time. simavr completes SPM instantly, the erase and
+		write times of real flash are not included.
+
+		stk500bench <elf> <mcu> [target name]
+*/
+
+#include	<stdint.h>
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+
+#include	<sim_avr.h>
+#include	<sim_elf.h>
+#include	<sim_irq.h>
+#include	<avr_uart.h>
+
+#include	"../command.h"
+
+#ifndef F_CPU
+	#define F_CPU 16000000UL
+#endif
+#ifndef BAUDRATE
+	#define BAUDRATE 115200UL
+#endif
+#ifndef BENCH_BYTES
+	#define BENCH_BYTES 8192U				// flash programmed and read back per session
+#endif
+
+#define	CYCLES_PER_BYTE	( F_CPU * 10UL / BAUDRATE )
+#define	ANSWER_TIMEOUT	( F_CPU / 2UL )			// cycles, no answer within 500 ms is an error
+#define	BOOT_TIMEOUT		( F_CPU * 3UL )			// cycles, longer than any BOOT_TIMEOUT_MS in the Makefile
+
+#define	UCSR0B_ADDRESS	0xC1								// same data address on all targets, simavr drops bytes while RXEN0 is off
+#define	RXEN0_BIT				4
+
+typedef struct {
+	const char*	name;
+	uint32_t		count;
+	uint64_t		cycles;				// command sent until the answer is complete
+	uint64_t		lineCycles;		// part of it taken by the bytes on the line
+} benchStat;
+
+typedef struct {
+	avr_t*			avr;
+	avr_irq_t*	input;
+	uint32_t		bootAddress;
+	uint8_t			seqNum;
+	uint8_t			xoff;
+	uint8_t			answer[1024];
+	uint16_t		answerLength;
+	uint8_t			answered;
+	uint64_t		firstByte;		// cycle the first byte of the last answer turned up
+	benchStat		stats[256];
+} benchHost;
+
+static void uartOutput(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	benchHost*	host	=	param;
+
+	if ( ( host->answerLength == 0 ) && ( value != MESSAGE_START ) ) {
+		return;
+	}
+	if (host->answerLength == 0) {
+		host->firstByte	=	host->avr->cycle;
+	}
+	if (host->answerLength < sizeof(host->answer)) {
+		host->answer[host->answerLength++]	=	value;
+	}
+	if ( ( host->answerLength >= 5 ) && ( host->answerLength == 6 + ( ( host->answer[2] << 8 ) | host->answer[3] ) ) ) {
+		host->answered	=	1;
+	}
+}
+
+static void uartXon(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	( (benchHost*)param )->xoff	=	0;
+}
+
+static void uartXoff(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	( (benchHost*)param )->xoff	=	1;
+}
+
+static avr_t* benchBoot(elf_firmware_t* firmware, const char* mcu, benchHost* host)
+{
+	avr_t*		avr	=	avr_make_mcu_by_name(mcu);
+	uint32_t	flags	=	0;
+
+	if (!avr) {
+		return NULL;
+	}
+	avr_init(avr);
+	avr->log	=	LOG_ERROR;
+	avr_load_firmware(avr, firmware);
+	// BOOTRST is set on all targets, start in the bootloader
+	avr->reset_pc	=	firmware->flashbase;
+	avr->pc				=	firmware->flashbase;
+
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags	&=	~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+	memset(host, 0, sizeof(*host));
+	host->avr					=	avr;
+	host->bootAddress	=	firmware->flashbase;
+	host->input				=	avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uartOutput, host);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON), uartXon, host);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF), uartXoff, host);
+
+	return avr;
+}
+
+/*
+ * Send one message and run until its answer is complete, returns the cycles it took or 0
+ */
+static uint64_t transact(benchHost* host, const char* name, const uint8_t* body, uint16_t length)
+{
+	uint8_t		frame[1024];
+	uint16_t	frameLength	=	length + 6;
+	uint16_t	sent				=	0;
+	uint8_t		checksum		=	0;
+	uint64_t	start				=	host->avr->cycle;
+	uint64_t	cycles;
+	benchStat*	stat			=	&host->stats[body[0]];
+
+	host->seqNum++;
+	frame[0]	=	MESSAGE_START;
+	frame[1]	=	host->seqNum;
+	frame[2]	=	length >> 8;
+	frame[3]	=	length & 0xFF;
+	frame[4]	=	TOKEN;
+	memcpy(frame + 5, body, length);
+	for (uint16_t i = 0; i < frameLength - 1; i++) {
+		checksum	^=	frame[i];
+	}
+	frame[frameLength - 1]	=	checksum;
+
+	host->answerLength	=	0;
+	host->answered			=	0;
+	while (!host->answered) {
+		if ( ( sent < frameLength ) && !host->xoff ) {
+			avr_raise_irq(host->input, frame[sent++]);
+		}
+		int state	=	avr_run(host->avr);
+		if ( ( state == cpu_Done ) || ( state == cpu_Crashed ) || ( host->avr->cycle - start > ANSWER_TIMEOUT ) ) {
+			fprintf(stderr, "no answer to %s\n", name);
+			return 0;
+		}
+	}
+	if ( ( host->answer[1] != host->seqNum ) || ( host->answer[5] != body[0] ) || ( host->answer[6] != STATUS_CMD_OK ) ) {
+		fprintf(stderr, "%s failed\n", name);
+		return 0;
+	}
+
+	cycles						=	host->avr->cycle - start;
+	stat->name				=	name;
+	stat->count++;
+	stat->cycles			+=	cycles;
+	stat->lineCycles	+=	(uint64_t)( frameLength + host->answerLength ) * CYCLES_PER_BYTE;
+	return cycles;
+}
+
+/*
+ * Run until the bootloader has enabled the USART receiver, returns the cycle or 0
+ */
+static uint64_t runToReceiver(benchHost* host)
+{
+	while (!( host->avr->data[UCSR0B_ADDRESS] & ( 1 << RXEN0_BIT ) )) {
+		int state	=	avr_run(host->avr);
+		if ( ( state == cpu_Done ) || ( state == cpu_Crashed ) || ( host->avr->cycle > BOOT_TIMEOUT ) ) {
+			return 0;
+		}
+	}
+	return host->avr->cycle;
+}
+
+/*
+ * Run until the bootloader has jumped into the application, returns the cycle or 0
+ */
+static uint64_t runToApp(benchHost* host)
+{
+	while (host->avr->pc >= host->bootAddress) {
+		int state	=	avr_run(host->avr);
+		if ( ( state == cpu_Done ) || ( state == cpu_Crashed ) || ( host->avr->cycle > BOOT_TIMEOUT ) ) {
+			return 0;
+		}
+	}
+	return host->avr->cycle;
+}
+
+static double cyclesToMs(uint64_t cycles)
+{
+	return cycles * 1000.0 / F_CPU;
+}
+
+int main(int argc, char* argv[])
+{
+	elf_firmware_t	firmware;
+	benchHost				host;
+	const char*			target;
+	uint16_t				pageSize;
+	uint8_t					image[BENCH_BYTES];
+	uint8_t					body[300];
+	uint64_t				cycles;
+	uint64_t				programCycles	=	0;
+	uint64_t				verifyCycles	=	0;
+	uint64_t				firstByte;
+	uint64_t				leave;
+	uint64_t				app;
+	uint64_t				timeout;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <elf> <mcu> [target name]\n", argv[0]);
+		return 1;
+	}
+	target		=	( argc > 3 ) ? argv[3] : argv[1];
+	pageSize	=	strstr(argv[2], "328") ? 128 : 256;
+
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(argv[1], &firmware)) {
+		fprintf(stderr, "%s: can not read %s\n", target, argv[1]);
+		return 1;
+	}
+	strncpy(firmware.mmcu, argv[2], sizeof(firmware.mmcu) - 1);
+	firmware.frequency	=	F_CPU;
+
+	// dense image, nothing repeats within a page
+	srand(1);
+	for (uint32_t i = 0; i < sizeof(image); i++) {
+		image[i]	=	rand();
+	}
+
+	/*
+	 * Session without a host, the full boot window runs out before the application starts.
+	 * Word 0 is set so appStart() finds an application.
+	 */
+	if (!benchBoot(&firmware, argv[2], &host)) {
+		fprintf(stderr, "%s: %s is not supported by simavr\n", target, argv[2]);
+		return 2;
+	}
+	host.avr->flash[0]	=	0;
+	host.avr->flash[1]	=	0;
+	timeout	=	runToApp(&host);
+	avr_terminate(host.avr);
+
+	/*
+	 * Session programming and verifying the image, the sign on goes out as soon as the
+	 * bootloader listens
+	 */
+	benchBoot(&firmware, argv[2], &host);
+	if (!runToReceiver(&host)) {
+		fprintf(stderr, "%s: the USART receiver is never enabled\n", target);
+		return 1;
+	}
+
+	body[0]	=	CMD_SIGN_ON;
+	if (!transact(&host, "CMD_SIGN_ON", body, 1)) {
+		return 1;
+	}
+	firstByte	=	host.firstByte;
+
+	body[0]	=	CMD_GET_PARAMETER;
+	body[1]	=	PARAM_HW_VER;
+	transact(&host, "CMD_GET_PARAMETER", body, 2);
+
+	memset(body, 0, 12);
+	body[0]	=	CMD_ENTER_PROGMODE_ISP;
+	transact(&host, "CMD_ENTER_PROGMODE_ISP", body, 12);
+
+	for (uint8_t i = 0; i < 3; i++) {
+		memset(body, 0, 4);
+		body[0]	=	CMD_READ_SIGNATURE_ISP;
+		body[4]	=	i;
+		transact(&host, "CMD_READ_SIGNATURE_ISP", body, 4);
+	}
+
+	memset(body, 0, 5);
+	body[0]	=	CMD_LOAD_ADDRESS;
+	transact(&host, "CMD_LOAD_ADDRESS", body, 5);
+	for (uint32_t offset = 0; offset < sizeof(image); offset += pageSize) {
+		body[0]	=	CMD_PROGRAM_FLASH_ISP;
+		body[1]	=	pageSize >> 8;
+		body[2]	=	pageSize & 0xFF;
+		memset(body + 3, 0, 7);
+		memcpy(body + 10, image + offset, pageSize);
+		if (!( cycles = transact(&host, "CMD_PROGRAM_FLASH_ISP", body, pageSize + 10) )) {
+			return 1;
+		}
+		programCycles	+=	cycles;
+	}
+
+	memset(body, 0, 5);
+	body[0]	=	CMD_LOAD_ADDRESS;
+	transact(&host, "CMD_LOAD_ADDRESS", body, 5);
+	for (uint32_t offset = 0; offset < sizeof(image); offset += pageSize) {
+		body[0]	=	CMD_READ_FLASH_ISP;
+		body[1]	=	pageSize >> 8;
+		body[2]	=	pageSize & 0xFF;
+		body[3]	=	0x20;
+		if (!( cycles = transact(&host, "CMD_READ_FLASH_ISP", body, 4) )) {
+			return 1;
+		}
+		if (memcmp(host.answer + 7, image + offset, pageSize)) {
+			fprintf(stderr, "%s: verify failed at 0x%05X\n", target, offset);
+			return 1;
+		}
+		verifyCycles	+=	cycles;
+	}
+
+	body[0]	=	CMD_LEAVE_PROGMODE_ISP;
+	body[1]	=	1;
+	body[2]	=	1;
+	transact(&host, "CMD_LEAVE_PROGMODE_ISP", body, 3);
+	leave	=	host.avr->cycle;
+	app		=	runToApp(&host);
+	avr_terminate(host.avr);
+
+	printf("%s (%s, %lu baud, %u bytes)\n", target, argv[2], BAUDRATE, BENCH_BYTES);
+	printf("  %-24s %6s %12s %12s %12s\n", "command", "count", "cycles", "turnaround", "ms");
+	for (uint16_t i = 0; i < 256; i++) {
+		benchStat*	stat	=	&host.stats[i];
+		if (stat->count) {
+			uint64_t	average			=	stat->cycles / stat->count;
+			uint64_t	turnaround	=	( stat->cycles - stat->lineCycles ) / stat->count;
+			printf("  %-24s %6u %12llu %12lld %12.3f\n", stat->name, stat->count, (unsigned long long)average, (long long)turnaround, cyclesToMs(average));
+		}
+	}
+	printf("  reset to first answer byte     %10.3f ms\n", cyclesToMs(firstByte));
+	if (timeout) {
+		printf("  reset to appStart(), no host   %10.3f ms\n", cyclesToMs(timeout));
+	}
+	if (app) {
+		printf("  leave progmode to appStart()   %10.3f ms\n", cyclesToMs(app - leave));
+	}
+	printf("  program                        %10.0f bytes/s\n", sizeof(image) * (double)F_CPU / programCycles);
+	printf("  verify                         %10.0f bytes/s\n", sizeof(image) * (double)F_CPU / verifyCycles);
+
+	return 0;
+}
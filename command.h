@@ -112,3 +112,49 @@
 
 #define ANSWER_CKSUM_ERROR                  0xB0
 
+// *****************[ Vendor command constants ]***************************
+
+#define CMD_CRC_FLASH                       0x40
+#define CMD_CRC_PAGES                       0x41
+#define CMD_PROGRAM_FLASH_LZ                0x42
+#define CMD_SESSION_INFO                    0x43
+
+// *****************[ Vendor parameter constants ]***************************
+
+#define PARAM_SKIPPED_PAGES_LOW             0xA0
+#define PARAM_SKIPPED_PAGES_HIGH            0xA1
+
+#define PARAM_BAUD_RATE                     0xA2
+#define PARAM_WINDOW_SIZE                   0xA3
+
+// first byte of the ENABLE_PERF_COUNTERS counters, 7 counters of 4 bytes
+#define PARAM_PERF_COUNTERS                 0xC0
+
+// *****************[ Session info capability flags ]***********************
+
+#define CAP_DOUBLE_BUFFER                   0x0001
+#define CAP_PAGE_COMPARE                    0x0002
+#define CAP_STREAMING_PROGRAM               0x0004
+#define CAP_STREAMING_READ                  0x0008
+#define CAP_BAUD_SWITCH                     0x0010
+#define CAP_AUTOBAUD                        0x0020
+#define CAP_FLASH_CRC                       0x0040
+#define CAP_COMPRESSED_PROGRAM              0x0080
+#define CAP_EEPROM                          0x0100
+#define CAP_CHECKSUM_NACK                   0x0200
+#define CAP_WINDOWED_PROGRAM                0x0400
+#define CAP_VERIFY                          0x0800
+#define CAP_CHIP_ERASE                      0x1000
+#define CAP_BOOT_REQUEST                    0x2000
+#define CAP_FLASH_SERVICE                   0x4000
+#define CAP_PERF_COUNTERS                   0x8000
+
+// second capability word, after NRWW_START in the session info
+#define CAP2_BOOT_POLICY                    0x0001
+#define CAP2_TRACE_PINS                     0x0002
+#define CAP2_RS485                          0x0004
+#define CAP2_STAGED_UPDATE                  0x0008
+#define CAP2_IMAGE_CHECK                    0x0010
+#define CAP2_FLOW_CONTROL                   0x0020
+#define CAP2_MULTI_PAGE_PROGRAM             0x0040
+
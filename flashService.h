@@ -0,0 +1,101 @@
+/*
+ * Flash write service of a bootloader built with ENABLE_FLASH_SERVICE, include this in the
+ * application to erase and write its own flash pages without a reset into the bootloader.
+ *
+ * Addresses are byte addresses below the bootloader, writes to the bootloader are refused
+ * with FLASH_SERVICE_FAILED. Each call runs with the interrupts off until SPM is done, an
+ * erase or write takes about 4 ms.
+ *
+ *	flashServiceErase(address);
+ *	for (offset = 0; offset < SPM_PAGESIZE; offset += 2) {
+ *		flashServiceFill(address + offset, word);
+ *	}
+ *	flashServiceWrite(address);
+ *
+ * or flashServiceProgram(address, page) with SPM_PAGESIZE bytes in RAM.
+ */
+
+#ifndef FLASH_SERVICE_H
+#define FLASH_SERVICE_H
+
+#include	<stdint.h>
+#include	<avr/io.h>
+
+#define FLASH_SERVICE_OK			0x00
+#define FLASH_SERVICE_FAILED		0xC0
+
+/*
+ * Byte address of the jump table, FLASH_SERVICE_ADDRESS in the Makefile
+ */
+#define FLASH_SERVICE_TABLE			( FLASHEND - 7UL )
+
+#define FLASH_SERVICE_ENTRY(n)		( (uint16_t)( ( FLASH_SERVICE_TABLE >> 1 ) + (n) ) )
+
+/*
+ * On the ATMega2560 the table is above 128K, the indirect call takes the top bits from EIND
+ */
+#ifdef EIND
+	#define FLASH_SERVICE_CALL_BEGIN()	EIND = (uint8_t)( FLASH_SERVICE_TABLE >> 17 )
+	#define FLASH_SERVICE_CALL_END()	EIND = 0
+#else
+	#define FLASH_SERVICE_CALL_BEGIN()
+	#define FLASH_SERVICE_CALL_END()
+#endif
+
+/*
+ * Staged updates of a bootloader built with ENABLE_STAGED_UPDATE. The application writes
+ * the new image from FLASH_SERVICE_STAGE_START on, then the header page, and resets. The
+ * bootloader copies an image whose CRC matches the header down to 0 before it starts it.
+ * The header holds the magic, a version of the application's choice, the length and the
+ * CRC-CCITT (0x8408 reflected, starting at 0xFFFF) of the staged bytes.
+ */
+#define FLASH_SERVICE_APP_END		( FLASHEND + 1UL - 4096UL )
+#define FLASH_SERVICE_STAGE_START	( ( FLASH_SERVICE_APP_END / 2 ) & ~( (uint32_t)SPM_PAGESIZE - 1 ) )
+#define FLASH_SERVICE_STAGE_HEADER	( FLASH_SERVICE_APP_END - SPM_PAGESIZE )
+#define FLASH_SERVICE_STAGE_MAGIC	0x5A17
+
+typedef struct {
+	uint16_t	magic;
+	uint16_t	version;
+	uint32_t	length;
+	uint16_t	crc;
+} flashServiceStageHeader;
+
+static inline uint8_t flashServiceErase(uint32_t address)
+{
+	uint8_t status;
+
+	FLASH_SERVICE_CALL_BEGIN();
+	status	=	( (uint8_t (*)(uint32_t))FLASH_SERVICE_ENTRY(0) )(address);
+	FLASH_SERVICE_CALL_END();
+	return status;
+}
+
+static inline void flashServiceFill(uint32_t address, uint16_t word)
+{
+	FLASH_SERVICE_CALL_BEGIN();
+	( (void (*)(uint32_t, uint16_t))FLASH_SERVICE_ENTRY(1) )(address, word);
+	FLASH_SERVICE_CALL_END();
+}
+
+static inline uint8_t flashServiceWrite(uint32_t address)
+{
+	uint8_t status;
+
+	FLASH_SERVICE_CALL_BEGIN();
+	status	=	( (uint8_t (*)(uint32_t))FLASH_SERVICE_ENTRY(2) )(address);
+	FLASH_SERVICE_CALL_END();
+	return status;
+}
+
+static inline uint8_t flashServiceProgram(uint32_t address, const uint8_t* data)
+{
+	uint8_t status;
+
+	FLASH_SERVICE_CALL_BEGIN();
+	status	=	( (uint8_t (*)(uint32_t, const uint8_t*))FLASH_SERVICE_ENTRY(3) )(address, data);
+	FLASH_SERVICE_CALL_END();
+	return status;
+}
+
+#endif
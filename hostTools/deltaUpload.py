@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""
+Upload only the pages of an Intel hex file that differ from the device.
+
+The page CRCs come from CMD_CRC_PAGES, so the bootloader has to be built with
+ENABLE_FLASH_CRC. Pages are compared and programmed one SPM_PAGESIZE at a time.
+
+    deltaUpload.py /dev/ttyUSB0 firmware.hex --mcu atmega2560
+"""
+
+import argparse
+import sys
+import time
+
+import stk500v2
+
+# SPM_PAGESIZE of the targets built by the Makefile
+PAGE_SIZES = {
+    'atmega2560': 256,
+    'atmega1280': 256,
+    'atmega1284p': 256,
+    'atmega328pb': 128,
+}
+
+
+def devicePageCrcs(device, pageAddresses, pageSize):
+    """Asks the device for the CRC of every listed page, in runs of adjacent pages"""
+    crcs = {}
+    pending = sorted(pageAddresses)
+    while pending:
+        first = pending[0]
+        count = 1
+        while count < len(pending) and pending[count] == first + count * pageSize:
+            count += 1
+        answer = device.crcPages(first, count)
+        for i, crc in enumerate(answer):
+            crcs[first + i * pageSize] = crc
+        pending = pending[len(answer):]
+    return crcs
+
+
+def pageRuns(addresses, pages, pageSize):
+    """Joins adjacent pages into (address, data) runs"""
+    runs = []
+    for address in sorted(addresses):
+        if runs and runs[-1][0] + len(runs[-1][1]) == address:
+            runs[-1][1].extend(pages[address])
+        else:
+            runs.append((address, bytearray(pages[address])))
+    return runs
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('port', help="serial port of the bootloader")
+    parser.add_argument('hexFile', help="Intel hex file to upload")
+    parser.add_argument('-b', '--baud', type=int, default=115200, help="baudrate (default 115200)")
+    parser.add_argument('-p', '--page-size', type=int, help="SPM_PAGESIZE of the target, taken from CMD_SESSION_INFO when the device has it")
+    parser.add_argument('-m', '--mcu', choices=sorted(PAGE_SIZES), default='atmega2560', help="target, sets the page size without session info (default atmega2560)")
+    parser.add_argument('-n', '--dry-run', action='store_true', help="only list the pages that would be written")
+    parser.add_argument('-w', '--window', type=int, default=0, help="program flash frames sent back to back, needs ENABLE_WINDOWED_PROGRAM")
+    parser.add_argument('-s', '--stats', action='store_true', help="print the device counters at the end, needs ENABLE_PERF_COUNTERS")
+    parser.add_argument('--f-cpu', type=int, default=16000000, help="F_CPU of the target for the counter times (default 16000000)")
+    parser.add_argument('--no-reset', action='store_true', help="do not pulse DTR / RTS before signing on")
+    parser.add_argument('--rtscts', action='store_true', help="RTS / CTS flow control, needs ENABLE_FLOW_CONTROL")
+    args = parser.parse_args()
+
+    image = stk500v2.readHex(args.hexFile)
+
+    device = stk500v2.Stk500v2(args.port, args.baud, reset=not args.no_reset, rtscts=args.rtscts)
+    try:
+        start = time.time()
+        info = device.connect()
+        pageSize = args.page_size or (info and info['pageSize']) or PAGE_SIZES[args.mcu]
+        pages = stk500v2.imagePages(image, pageSize)
+        print("connected, %d byte pages" % pageSize)
+
+        deviceCrcs = devicePageCrcs(device, pages.keys(), pageSize)
+        changed = [address for address in sorted(pages) if deviceCrcs[address] != stk500v2.crc16(pages[address])]
+        print("%d of %d pages differ" % (len(changed), len(pages)))
+
+        if not args.dry_run:
+            window = device.setWindow(args.window) if args.window else 0
+            for address, run in pageRuns(changed, pages, pageSize):
+                if window:
+                    device.programFlashWindowed(address, run, pageSize, window)
+                else:
+                    for offset in range(0, len(run), pageSize):
+                        device.programFlash(address + offset, run[offset:offset + pageSize])
+
+            deviceCrcs = devicePageCrcs(device, changed, pageSize)
+            failed = [address for address in changed if deviceCrcs[address] != stk500v2.crc16(pages[address])]
+            if failed:
+                print("verify failed at " + ", ".join("0x%05X" % address for address in failed))
+                return 1
+
+        if args.stats:
+            counters = device.perfCounters(args.f_cpu)
+            for name in stk500v2.PERF_COUNTERS:
+                if name in stk500v2.PERF_TIMES:
+                    print("%-16s %.3f s" % (name, counters[name]))
+                else:
+                    print("%-16s %d" % (name, counters[name]))
+
+        device.leaveProgmode()
+        print("done in %.2f s" % (time.time() - start))
+    except stk500v2.Stk500v2Error as error:
+        print("error: %s" % error)
+        return 1
+    finally:
+        device.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
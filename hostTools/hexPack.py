@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""
+Pack an Intel hex file into the fewest program flash frames.
+
+Pages holding nothing but 0xFF are dropped, the pages left are merged into runs of adjacent
+pages and every run goes out in blocks of --block-pages pages, with one load address per run.
+A sparse image then costs time for its real content only. Blocks of more than one page need
+a bootloader built with ENABLE_MULTI_PAGE_PROGRAM, the block is cut to the block size its
+session info reports and to one page on any other device. Uploading, the device is chip
+erased first so the dropped pages read 0xFF. A device without ENABLE_CHIP_ERASE gets
+every page, the 0xFF pages included.
+
+    hexPack.py firmware.hex packed.hex --mcu atmega2560
+    hexPack.py firmware.hex --port /dev/ttyUSB0 --block-pages 4
+"""
+
+import argparse
+import sys
+import time
+
+import deltaUpload
+import stk500v2
+
+
+def packedRuns(image, pageSize, drop=True):
+    """(address, data) runs of the pages that hold anything but 0xFF, and the pages dropped"""
+    pages = stk500v2.imagePages(image, pageSize)
+    used = [address for address, page in pages.items() if not drop or page.count(0xFF) != len(page)]
+    return deltaUpload.pageRuns(used, pages, pageSize), len(pages) - len(used)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('hexFile', help="Intel hex file to pack")
+    parser.add_argument('output', nargs='?', help="Intel hex file without the 0xFF pages")
+    parser.add_argument('-m', '--mcu', choices=sorted(deltaUpload.PAGE_SIZES), default='atmega2560', help="target, sets the page size (default atmega2560)")
+    parser.add_argument('-p', '--page-size', type=int, help="SPM_PAGESIZE of the target")
+    parser.add_argument('-k', '--block-pages', type=int, default=1, help="pages per program flash frame (default 1)")
+    parser.add_argument('--port', help="upload the packed image to the bootloader on this serial port")
+    parser.add_argument('-b', '--baud', type=int, default=115200, help="baudrate (default 115200)")
+    parser.add_argument('--no-reset', action='store_true', help="do not pulse DTR / RTS before signing on")
+    args = parser.parse_args()
+    if not args.output and not args.port:
+        parser.error("give an output file, --port or both")
+
+    image = stk500v2.readHex(args.hexFile)
+
+    if args.output:
+        pageSize = args.page_size or deltaUpload.PAGE_SIZES[args.mcu]
+        runs, dropped = packedRuns(image, pageSize)
+        pages = sum(len(data) for address, data in runs) // pageSize
+        print("%d pages in %d runs, %d pages of 0xFF dropped" % (pages, len(runs), dropped))
+        stk500v2.writeHex(args.output, {address + offset: value for address, data in runs for offset, value in enumerate(data)})
+
+    if args.port:
+        device = stk500v2.Stk500v2(args.port, args.baud, reset=not args.no_reset)
+        try:
+            info = device.connect()
+            pageSize = args.page_size or (info and info['pageSize']) or deltaUpload.PAGE_SIZES[args.mcu]
+            # only a device reporting its block size takes more than a page per frame
+            blockPages = 1
+            if info and info['blockSize'] and info['blockSize'] > pageSize:
+                blockPages = max(1, min(args.block_pages, info['blockSize'] // pageSize))
+            # without a chip erase a dropped page would keep the old code, so nothing is dropped
+            chipErase = bool(info) and 'chipErase' in info['capabilities']
+            if chipErase:
+                device.chipErase()
+            runs, dropped = packedRuns(image, pageSize, chipErase)
+            pages = sum(len(data) for address, data in runs) // pageSize
+            print("%d pages in %d runs, %d pages of 0xFF dropped" % (pages, len(runs), dropped))
+
+            start = time.time()
+            frames = 0
+            for address, data in runs:
+                device.programFlashBlocks(address, data, blockPages * pageSize)
+                frames += 1 + -(-len(data) // (blockPages * pageSize))
+            device.leaveProgmode()
+            print("%d frames of up to %d pages in %.2f s" % (frames, blockPages, time.time() - start))
+        except stk500v2.Stk500v2Error as error:
+            print("error: %s" % error)
+            return 1
+        finally:
+            device.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""
+Time complete flash sessions on a connected board at every baudrate it supports.
+
+Each reference image (dense, patch of dense, sparse, all 0xFF) is flashed after a reset
+of the board. The wall clock time is split into sign on, erase, program and verify, and
+the round trip of every command type is recorded. The images overwrite the application,
+--app puts one back at the end.
+
+The board is reset the ways resetTest.ino reports them: an external reset by DTR / RTS,
+or with --reset watchdog by sending 'b' to the running application, which enters the
+bootloader through a watchdog reset (ENABLE_BOOT_REQUEST). Only the first session finds
+that application, later sessions use the external reset.
+
+    hwBench.py /dev/ttyUSB0 --mcu atmega2560 --size 65536 --app resetTest.hex
+"""
+
+import argparse
+import random
+import sys
+import time
+
+import deltaUpload
+import stk500v2
+
+COMMAND_NAMES = {value: name for name, value in vars(stk500v2).items() if name.startswith('CMD_')}
+
+
+class TimedDevice(stk500v2.Stk500v2):
+    """Records the round trip of every command by command id"""
+
+    def __init__(self, *args, **kwargs):
+        self.roundTrips = {}
+        super().__init__(*args, **kwargs)
+
+    def command(self, body, retries=3):
+        start = time.perf_counter()
+        try:
+            return super().command(body, retries)
+        finally:
+            self.roundTrips.setdefault(body[0], []).append(time.perf_counter() - start)
+
+
+def referenceImages(size, pageSize):
+    """(name, {page address: bytes}) in the order they are flashed"""
+    generator = random.Random(1)
+    dense = bytes(generator.randrange(256) for _ in range(size))
+    densePages = {address: dense[address:address + pageSize] for address in range(0, size, pageSize)}
+
+    # one byte changed in every 16th page of the dense image
+    patchPages = dict(densePages)
+    for address in range(0, size, 16 * pageSize):
+        page = bytearray(patchPages[address])
+        page[0] ^= 0xFF
+        patchPages[address] = bytes(page)
+
+    # reset vector, a table in the middle and data at the top, the rest left out
+    sparsePages = {}
+    for address in (0, (size // 2) - (size // 2) % pageSize, size - pageSize):
+        sparsePages[address] = densePages[address]
+
+    blankPages = {address: b'\xff' * pageSize for address in range(0, size, pageSize)}
+
+    return [('dense', densePages), ('patch', patchPages), ('sparse', sparsePages), ('blank', blankPages)]
+
+
+def resetBoard(device, method, appBaud):
+    if method == 'watchdog':
+        time.sleep(0.5)             # an application started by the last leave progmode opens its port first
+        device.serial.baudrate = appBaud
+        device.serial.write(b'b')
+        device.serial.flush()
+        time.sleep(0.05)
+        device.serial.baudrate = device.baudrate
+        device.serial.reset_input_buffer()
+    else:
+        device.reset()
+
+
+def flashSession(device, pages, pageSize, baudrate, resetMethod, appBaud, delta):
+    """Flashes pages and returns the phase times in seconds and the pages that failed verify"""
+    phases = {}
+    start = time.perf_counter()
+
+    resetBoard(device, resetMethod, appBaud)
+    info = device.connect()
+    if baudrate != device.baudrate:
+        device.switchBaud(baudrate)
+    capabilities = info['capabilities'] if info else []
+    phases['signOn'] = time.perf_counter() - start
+
+    start = time.perf_counter()
+    if delta and 'flashCrc' in capabilities:
+        # leave flash as it is and only write the pages that differ
+        crcs = deltaUpload.devicePageCrcs(device, pages.keys(), pageSize)
+        changed = [address for address in sorted(pages) if crcs[address] != stk500v2.crc16(pages[address])]
+    else:
+        if 'chipErase' in capabilities:
+            device.chipErase()
+        changed = sorted(pages)
+    phases['erase'] = time.perf_counter() - start
+
+    start = time.perf_counter()
+    for address in changed:
+        device.programFlash(address, pages[address])
+    phases['program'] = time.perf_counter() - start
+
+    start = time.perf_counter()
+    failed = [address for address in sorted(pages) if device.readFlash(address, pageSize) != pages[address]]
+    phases['verify'] = time.perf_counter() - start
+
+    device.leaveProgmode()
+    return phases, len(changed), failed
+
+
+def flashApp(device, hexFile, pageSize, appBaud):
+    """Puts the application back and prints its first lines, resetTest.ino reports the reset source"""
+    pages = stk500v2.imagePages(stk500v2.readHex(hexFile), pageSize)
+    device.reset()
+    info = device.connect()
+    if info and 'chipErase' in info['capabilities']:
+        device.chipErase()
+    for address in sorted(pages):
+        device.programFlash(address, pages[address])
+    device.leaveProgmode()
+
+    device.serial.baudrate = appBaud
+    deadline = time.time() + 3
+    while time.time() < deadline:
+        line = device.serial.readline().decode('ascii', 'replace').strip()
+        if line:
+            print("app: %s" % line)
+    device.serial.baudrate = device.baudrate
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('port', help="serial port of the bootloader")
+    parser.add_argument('-b', '--baud', type=int, default=115200, help="baudrate the bootloader was built for (default 115200)")
+    parser.add_argument('-p', '--page-size', type=int, help="SPM_PAGESIZE of the target, taken from CMD_SESSION_INFO when the device has it")
+    parser.add_argument('-m', '--mcu', choices=sorted(deltaUpload.PAGE_SIZES), default='atmega2560', help="target, sets the page size without session info (default atmega2560)")
+    parser.add_argument('-s', '--size', type=int, default=32768, help="bytes in the reference images (default 32768)")
+    parser.add_argument('-r', '--rates', type=int, nargs='+', help="baudrates to run, default all the device supports")
+    parser.add_argument('--reset', choices=('dtr', 'watchdog'), default='dtr', help="how the first session resets the board (default dtr)")
+    parser.add_argument('--app-baud', type=int, default=57600, help="baudrate of the application for --reset watchdog and --app (default 57600)")
+    parser.add_argument('--app', help="Intel hex file flashed after the benchmark, e.g. a resetTest.ino build")
+    parser.add_argument('--delta', action='store_true', help="write only the pages whose CRC differs, needs ENABLE_FLASH_CRC")
+    parser.add_argument('--rtscts', action='store_true', help="RTS / CTS flow control, needs ENABLE_FLOW_CONTROL")
+    args = parser.parse_args()
+
+    device = TimedDevice(args.port, args.baud, reset=False, rtscts=args.rtscts)
+    try:
+        resetBoard(device, args.reset, args.app_baud)
+        info = device.connect()
+        pageSize = args.page_size or (info and info['pageSize']) or deltaUpload.PAGE_SIZES[args.mcu]
+        if info and args.size > info['appEnd']:
+            print("error: %d bytes do not fit below 0x%05X" % (args.size, info['appEnd']))
+            return 1
+        rates = args.rates or device.baudRates()
+        device.leaveProgmode()
+
+        images = referenceImages(args.size - args.size % pageSize, pageSize)
+        capabilities = info['capabilities'] if info else []
+        if 'chipErase' not in capabilities and not (args.delta and 'flashCrc' in capabilities):
+            # the pages left out would keep the last image, the session is no sparse upload then
+            print("sparse image skipped, the device has neither ENABLE_CHIP_ERASE nor --delta with ENABLE_FLASH_CRC")
+            images = [(name, pages) for name, pages in images if name != 'sparse']
+        resetMethod = args.reset
+        print("%8s %-7s %6s %8s %8s %8s %8s %8s %10s" % ('baud', 'image', 'pages', 'signOn', 'erase', 'program', 'verify', 'total', 'bytes/s'))
+        for baudrate in rates:
+            for name, pages in images:
+                phases, written, failed = flashSession(device, pages, pageSize, baudrate, resetMethod, args.app_baud, args.delta)
+                resetMethod = 'dtr'
+                total = sum(phases.values())
+                print("%8d %-7s %6d %8.3f %8.3f %8.3f %8.3f %8.3f %10.0f" % (
+                    baudrate, name, written, phases['signOn'], phases['erase'], phases['program'], phases['verify'], total,
+                    len(pages) * pageSize / total))
+                if failed:
+                    print("verify failed at " + ", ".join("0x%05X" % address for address in failed))
+                    return 1
+
+        print()
+        print("%-24s %6s %8s %8s %8s" % ('round trip (ms)', 'count', 'min', 'avg', 'max'))
+        for command in sorted(device.roundTrips):
+            times = device.roundTrips[command]
+            print("%-24s %6d %8.2f %8.2f %8.2f" % (
+                COMMAND_NAMES.get(command, '0x%02X' % command), len(times), 1000 * min(times), 1000 * sum(times) / len(times), 1000 * max(times)))
+
+        if args.app:
+            flashApp(device, args.app, pageSize, args.app_baud)
+    except stk500v2.Stk500v2Error as error:
+        print("error: %s" % error)
+        return 1
+    finally:
+        device.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
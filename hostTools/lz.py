@@ -0,0 +1,97 @@
+"""
+LZ stream for CMD_PROGRAM_FLASH_LZ, see programCompressed() in stk500boot.c.
+
+A token below 0x80 is followed by token + 1 literal bytes. Otherwise (token & 0x7F) + 3
+bytes are copied from a distance of 1 to 65535 bytes back, given by the next two bytes MSB
+first. The copy may come from anything inflated before, the device reads it back from flash.
+"""
+
+MIN_MATCH = 3
+MAX_MATCH = 0x7F + MIN_MATCH
+MAX_LITERAL = 0x80
+MAX_DISTANCE = 0xFFFF
+MAX_CANDIDATES = 32
+
+
+class Compressor:
+    """Compresses an image a range at a time, matches can reach back into earlier ranges"""
+
+    def __init__(self, data):
+        self.data = bytes(data)
+        self.table = {}
+        self.indexed = 0
+
+    def index(self, position):
+        while self.indexed < position:
+            key = self.data[self.indexed:self.indexed + MIN_MATCH]
+            if len(key) == MIN_MATCH:
+                self.table.setdefault(key, []).append(self.indexed)
+            self.indexed += 1
+
+    def findMatch(self, position, end):
+        """Longest match for data[position:end], returns (length, distance)"""
+        data = self.data
+        best = (0, 0)
+        limit = min(MAX_MATCH, end - position)
+        if limit < MIN_MATCH:
+            return best
+        candidates = self.table.get(data[position:position + MIN_MATCH], ())
+        for source in reversed(candidates[-MAX_CANDIDATES:]):
+            distance = position - source
+            if distance > MAX_DISTANCE:
+                break
+            length = 0
+            while length < limit and data[source + length] == data[position + length]:
+                length += 1
+            if length > best[0]:
+                best = (length, distance)
+                if length == limit:
+                    break
+        return best
+
+    def compress(self, start, end):
+        """Token stream producing data[start:end]"""
+        stream = bytearray()
+        literals = bytearray()
+
+        def flushLiterals():
+            while literals:
+                run = literals[:MAX_LITERAL]
+                stream.append(len(run) - 1)
+                stream.extend(run)
+                del literals[:MAX_LITERAL]
+
+        position = start
+        while position < end:
+            self.index(position)
+            length, distance = self.findMatch(position, end)
+            if length >= MIN_MATCH:
+                flushLiterals()
+                stream.append(0x80 | (length - MIN_MATCH))
+                stream.append(distance >> 8)
+                stream.append(distance & 0xFF)
+                position += length
+            else:
+                literals.append(self.data[position])
+                position += 1
+        flushLiterals()
+        return bytes(stream)
+
+
+def decompress(stream, history=b''):
+    """Reference inflater, returns the bytes the stream adds to history"""
+    output = bytearray(history)
+    start = len(output)
+    i = 0
+    while i < len(stream):
+        token = stream[i]
+        i += 1
+        if token & 0x80:
+            distance = (stream[i] << 8) | stream[i + 1]
+            i += 2
+            for _ in range((token & 0x7F) + MIN_MATCH):
+                output.append(output[-distance])
+        else:
+            output.extend(stream[i:i + token + 1])
+            i += token + 1
+    return bytes(output[start:])
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""
+Upload an Intel hex file as an LZ compressed stream.
+
+The bootloader has to be built with ENABLE_COMPRESSED_PROGRAM, e.g. make mega2560-multi-lz.
+The image is sent from its first to its last page, gaps are filled with 0xFF.
+
+    lzUpload.py /dev/ttyUSB0 firmware.hex --mcu atmega2560
+"""
+
+import argparse
+import sys
+import time
+
+import lz
+import stk500v2
+
+# SPM_PAGESIZE of the targets built by the Makefile
+PAGE_SIZES = {
+    'atmega2560': 256,
+    'atmega1280': 256,
+    'atmega1284p': 256,
+    'atmega328pb': 128,
+}
+
+
+def messages(data, pageSize, streamMax=stk500v2.LZ_STREAM_MAX):
+    """Splits the image into (size, stream) messages of whole pages that fit streamMax bytes"""
+    compressor = lz.Compressor(data)
+    size = 0
+    stream = b''
+    for start in range(0, len(data), pageSize):
+        page = compressor.compress(start, start + pageSize)
+        if size and len(stream) + len(page) > streamMax:
+            yield size, stream
+            size = 0
+            stream = b''
+        size += pageSize
+        stream += page
+    if size:
+        yield size, stream
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('port', help="serial port of the bootloader")
+    parser.add_argument('hexFile', help="Intel hex file to upload")
+    parser.add_argument('-b', '--baud', type=int, default=115200, help="baudrate (default 115200)")
+    parser.add_argument('-p', '--page-size', type=int, help="SPM_PAGESIZE of the target")
+    parser.add_argument('-m', '--mcu', choices=sorted(PAGE_SIZES), default='atmega2560', help="target, sets the page size (default atmega2560)")
+    parser.add_argument('-n', '--dry-run', action='store_true', help="only compress and report the ratio")
+    parser.add_argument('--verify', action='store_true', help="read the flash back after programming")
+    parser.add_argument('--no-reset', action='store_true', help="do not pulse DTR / RTS before signing on")
+    args = parser.parse_args()
+
+    pageSize = args.page_size or PAGE_SIZES[args.mcu]
+    image = stk500v2.readHex(args.hexFile)
+    first = min(image) - (min(image) % pageSize)
+    last = max(image) + pageSize - (max(image) % pageSize)
+    data = bytes(image.get(address, 0xFF) for address in range(first, last))
+
+    blocks = list(messages(data, pageSize))
+    if lz.decompress(b''.join(stream for size, stream in blocks)) != data:
+        print("error: the stream does not inflate to the image")
+        return 1
+    streamSize = sum(len(stream) + 5 for size, stream in blocks)
+    print("%d bytes in %d messages, %d bytes sent (%.0f%%)" % (len(data), len(blocks), streamSize, 100.0 * streamSize / len(data)))
+    if args.dry_run:
+        return 0
+
+    device = stk500v2.Stk500v2(args.port, args.baud, reset=not args.no_reset)
+    try:
+        start = time.time()
+        info = device.connect()
+        if info and info['pageSize'] != pageSize:
+            print("error: the device has %d byte pages" % info['pageSize'])
+            return 1
+        if device.lzStreamMax != stk500v2.LZ_STREAM_MAX:
+            blocks = list(messages(data, pageSize, device.lzStreamMax))
+        device.loadAddress(first)
+        for size, stream in blocks:
+            device.programFlashCompressed(size, stream)
+        if args.verify:
+            for address in range(first, last, pageSize):
+                if device.readFlash(address, pageSize) != data[address - first:address - first + pageSize]:
+                    print("verify failed at 0x%05X" % address)
+                    return 1
+        device.leaveProgmode()
+        print("done in %.2f s" % (time.time() - start))
+    except stk500v2.Stk500v2Error as error:
+        print("error: %s" % error)
+        return 1
+    finally:
+        device.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+Flash one Intel hex file to many boards at once, one session per serial port.
+
+The image is parsed, split into pages and its page CRCs calculated once for all ports.
+Every port then runs its own session in a thread, using what its bootloader offers:
+only the pages whose CRC differs with ENABLE_FLASH_CRC, back to back program flash
+frames with ENABLE_WINDOWED_PROGRAM and resending damaged frames straight away with
+ENABLE_CHECKSUM_NACK. Without those the pages are programmed and read back one by one.
+
+    multiFlash.py firmware.hex /dev/ttyUSB0 /dev/ttyUSB1 /dev/ttyUSB2 --window 4
+"""
+
+import argparse
+import sys
+import threading
+import time
+
+import deltaUpload
+import stk500v2
+
+
+class SharedImage:
+    """Pages of the image and their CRCs, read only once the sessions run"""
+
+    def __init__(self, fileName, pageSize):
+        self.pageSize = pageSize
+        self.pages = stk500v2.imagePages(stk500v2.readHex(fileName), pageSize)
+        self.crcs = {address: stk500v2.crc16(page) for address, page in self.pages.items()}
+
+
+class Session(threading.Thread):
+    def __init__(self, port, image, args):
+        super().__init__(name=port)
+        self.port = port
+        self.image = image
+        self.args = args
+        self.result = None
+        self.written = 0
+        self.elapsed = 0.0
+
+    def run(self):
+        start = time.time()
+        try:
+            self.flash()
+            self.result = "ok"
+        except (stk500v2.Stk500v2Error, OSError) as error:
+            self.result = "error: %s" % error
+        self.elapsed = time.time() - start
+
+    def flash(self):
+        image = self.image
+        device = stk500v2.Stk500v2(self.port, self.args.baud, reset=not self.args.no_reset, rtscts=self.args.rtscts)
+        try:
+            info = device.connect()
+            capabilities = info['capabilities'] if info else []
+            if info and info['pageSize'] != image.pageSize:
+                raise stk500v2.Stk500v2Error("the device has %d byte pages" % info['pageSize'])
+
+            useCrc = 'flashCrc' in capabilities
+            if useCrc:
+                deviceCrcs = deltaUpload.devicePageCrcs(device, image.pages.keys(), image.pageSize)
+                changed = [address for address in sorted(image.pages) if deviceCrcs[address] != image.crcs[address]]
+            else:
+                changed = sorted(image.pages)
+
+            window = 0
+            if self.args.window and 'windowedProgram' in capabilities:
+                window = device.setWindow(self.args.window)
+            for address, run in deltaUpload.pageRuns(changed, image.pages, image.pageSize):
+                if window:
+                    device.programFlashWindowed(address, run, image.pageSize, window)
+                else:
+                    for offset in range(0, len(run), image.pageSize):
+                        device.programFlash(address + offset, run[offset:offset + image.pageSize])
+            self.written = len(changed)
+
+            if useCrc:
+                deviceCrcs = deltaUpload.devicePageCrcs(device, changed, image.pageSize)
+                failed = [address for address in changed if deviceCrcs[address] != image.crcs[address]]
+            else:
+                failed = [address for address in changed if device.readFlash(address, image.pageSize) != image.pages[address]]
+            if failed:
+                raise stk500v2.Stk500v2Error("verify failed at " + ", ".join("0x%05X" % address for address in failed))
+
+            device.leaveProgmode()
+        finally:
+            device.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('hexFile', help="Intel hex file to upload")
+    parser.add_argument('ports', nargs='+', help="serial ports of the bootloaders")
+    parser.add_argument('-b', '--baud', type=int, default=115200, help="baudrate (default 115200)")
+    parser.add_argument('-p', '--page-size', type=int, help="SPM_PAGESIZE of the targets")
+    parser.add_argument('-m', '--mcu', choices=sorted(deltaUpload.PAGE_SIZES), default='atmega2560', help="target, sets the page size (default atmega2560)")
+    parser.add_argument('-w', '--window', type=int, default=4, help="program flash frames sent back to back where the device allows it, 0 turns it off (default 4)")
+    parser.add_argument('--no-reset', action='store_true', help="do not pulse DTR / RTS before signing on")
+    parser.add_argument('--rtscts', action='store_true', help="RTS / CTS flow control, needs ENABLE_FLOW_CONTROL")
+    args = parser.parse_args()
+
+    image = SharedImage(args.hexFile, args.page_size or deltaUpload.PAGE_SIZES[args.mcu])
+    print("%d pages of %d bytes to %d ports" % (len(image.pages), image.pageSize, len(args.ports)))
+
+    start = time.time()
+    sessions = [Session(port, image, args) for port in args.ports]
+    for session in sessions:
+        session.start()
+    for session in sessions:
+        session.join()
+
+    for session in sessions:
+        print("%-20s %4d pages %7.2f s  %s" % (session.port, session.written, session.elapsed, session.result))
+    failed = sum(1 for session in sessions if session.result != "ok")
+    print("%d of %d boards flashed in %.2f s" % (len(sessions) - failed, len(sessions), time.time() - start))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""
+Flash one Intel hex file to every node on a RS-485 bus, bootloaders built with ENABLE_RS485.
+
+Every node is signed on by its address first. The pages then go out once as group frames,
+which every node programs and none answers, so the host waits --page-delay after each one
+for the slowest node to finish its SPM. After that each node is asked by its own address
+for the CRC of every page (ENABLE_FLASH_CRC) or reads them back, pages that came out wrong
+are programmed one by one on that node and checked again.
+
+The node address is the last EEPROM byte of each board, the group address the one before.
+
+    rs485Flash.py firmware.hex /dev/ttyUSB0 --nodes 1 2 3 --group 0x80
+"""
+
+import argparse
+import sys
+import time
+
+import deltaUpload
+import stk500v2
+
+
+def broadcastPages(device, pages, group, delay):
+    """Programs all pages on every node of group, page by page"""
+    for address in sorted(pages):
+        device.broadcast(stk500v2.loadAddressBody(address), group)
+        device.broadcast(stk500v2.programFlashBody(pages[address]), group)
+        time.sleep(delay)
+
+
+def failedPages(device, pages, pageSize, useCrc):
+    if useCrc:
+        crcs = deltaUpload.devicePageCrcs(device, pages.keys(), pageSize)
+        return [address for address in sorted(pages) if crcs[address] != stk500v2.crc16(pages[address])]
+    return [address for address in sorted(pages) if device.readFlash(address, pageSize) != pages[address]]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('hexFile', help="Intel hex file to upload")
+    parser.add_argument('port', help="serial port of the RS-485 adapter")
+    parser.add_argument('-n', '--nodes', type=lambda value: int(value, 0), nargs='+', required=True, help="node addresses on the bus")
+    parser.add_argument('-g', '--group', type=lambda value: int(value, 0), default=stk500v2.RS485_BROADCAST, help="group address of the nodes (default 0xFF, every node)")
+    parser.add_argument('-b', '--baud', type=int, default=115200, help="baudrate (default 115200)")
+    parser.add_argument('-p', '--page-size', type=int, help="SPM_PAGESIZE of the targets")
+    parser.add_argument('-m', '--mcu', choices=sorted(deltaUpload.PAGE_SIZES), default='atmega2560', help="target, sets the page size (default atmega2560)")
+    parser.add_argument('-d', '--page-delay', type=float, default=0.02, help="seconds between group pages, an erase and a write take about 9 ms (default 0.02)")
+    parser.add_argument('-r', '--retries', type=int, default=2, help="rounds of programming failed pages per node (default 2)")
+    args = parser.parse_args()
+
+    pageSize = args.page_size or deltaUpload.PAGE_SIZES[args.mcu]
+    pages = stk500v2.imagePages(stk500v2.readHex(args.hexFile), pageSize)
+
+    device = stk500v2.Stk500v2(args.port, args.baud, reset=False)
+    failed = 0
+    try:
+        capabilities = {}
+        for node in args.nodes:
+            device.node = node
+            info = device.connect()
+            capabilities[node] = info['capabilities'] if info else []
+            if info and info['pageSize'] != pageSize:
+                print("error: node %d has %d byte pages" % (node, info['pageSize']))
+                return 1
+
+        start = time.time()
+        broadcastPages(device, pages, args.group, args.page_delay)
+        print("%d pages of %d bytes sent to group 0x%02X in %.2f s" % (len(pages), pageSize, args.group, time.time() - start))
+
+        for node in args.nodes:
+            device.node = node
+            useCrc = 'flashCrc' in capabilities[node]
+            try:
+                bad = failedPages(device, pages, pageSize, useCrc)
+                rounds = args.retries
+                while bad and rounds:
+                    rounds -= 1
+                    for address in bad:
+                        device.programFlash(address, pages[address])
+                    bad = [address for address in bad if address in failedPages(device, {address: pages[address]}, pageSize, useCrc)]
+                if bad:
+                    raise stk500v2.Stk500v2Error("verify failed at " + ", ".join("0x%05X" % address for address in bad))
+                device.leaveProgmode()
+                print("node %3d ok" % node)
+            except stk500v2.Stk500v2Error as error:
+                print("node %3d error: %s" % (node, error))
+                failed += 1
+    except stk500v2.Stk500v2Error as error:
+        print("error: %s" % error)
+        return 1
+    finally:
+        device.close()
+    print("%d of %d nodes flashed" % (len(args.nodes) - failed, len(args.nodes)))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+Turn an application hex file into a staged update for ENABLE_STAGED_UPDATE.
+
+The image is moved to the upper half of the application section and padded with 0xFF to
+whole pages, the header page below the bootloader gets the magic, version, length and CRC.
+At the next reset the bootloader copies the image down to 0 and erases the header.
+
+The output can be written by the running application through the flash service, by avrdude
+with -D (its chip erase would take the running application with it), or with --port straight
+through the bootloader, the header page always goes last. The bootloader erases every page it
+writes, the application pages below the staging area are left alone.
+
+    stageHex.py firmware.hex staged.hex --mcu atmega2560 --version 7
+    stageHex.py firmware.hex --port /dev/ttyUSB0 --version 7
+"""
+
+import argparse
+import sys
+
+import deltaUpload
+import stk500v2
+
+STAGE_MAGIC = 0x5A17
+
+# first byte of the 2048 byte boot section times two, the APP_END of the stage targets
+APP_ENDS = {
+    'atmega328pb': 0x7000,
+    'atmega1280': 0x1F000,
+    'atmega1284p': 0x1F000,
+    'atmega2560': 0x3F000,
+}
+
+
+def stageLayout(appEnd, pageSize):
+    """(start of the staged image, header page address), as STAGE_START and STAGE_HEADER"""
+    return (appEnd // 2) & ~(pageSize - 1), appEnd - pageSize
+
+
+def stagePages(image, appEnd, pageSize, version):
+    """{page address: bytes} of the staged image, the header page included"""
+    start, header = stageLayout(appEnd, pageSize)
+    length = max(image) + 1
+    if length > header - start:
+        raise ValueError("%d bytes do not fit the %d bytes of the staging area" % (length, header - start))
+
+    staged = bytearray(b'\xff' * (-(-length // pageSize) * pageSize))
+    for address, value in image.items():
+        staged[address] = value
+    crc = stk500v2.crc16(staged[:length])
+
+    pages = {start + offset: bytes(staged[offset:offset + pageSize]) for offset in range(0, len(staged), pageSize)}
+    headerPage = bytearray(b'\xff' * pageSize)
+    headerPage[0:10] = bytes([STAGE_MAGIC & 0xFF, STAGE_MAGIC >> 8, version & 0xFF, version >> 8,
+                              length & 0xFF, (length >> 8) & 0xFF, (length >> 16) & 0xFF, length >> 24, crc & 0xFF, crc >> 8])
+    pages[header] = bytes(headerPage)
+    return pages
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('hexFile', help="Intel hex file of the application")
+    parser.add_argument('output', nargs='?', help="Intel hex file of the staged update")
+    parser.add_argument('-m', '--mcu', choices=sorted(APP_ENDS), default='atmega2560', help="target (default atmega2560)")
+    parser.add_argument('-v', '--version', type=lambda value: int(value, 0), default=0, help="version stored in the header, 0 to 0xFFFF (default 0)")
+    parser.add_argument('--port', help="write the staged update through the bootloader on this serial port")
+    parser.add_argument('-b', '--baud', type=int, default=115200, help="baudrate (default 115200)")
+    args = parser.parse_args()
+    if not args.output and not args.port:
+        parser.error("give an output file, --port or both")
+
+    pageSize = deltaUpload.PAGE_SIZES[args.mcu]
+    appEnd = APP_ENDS[args.mcu]
+    try:
+        pages = stagePages(stk500v2.readHex(args.hexFile), appEnd, pageSize, args.version)
+    except ValueError as error:
+        print("error: %s" % error)
+        return 1
+    start, header = stageLayout(appEnd, pageSize)
+    print("%d bytes staged at 0x%05X, header at 0x%05X" % ((len(pages) - 1) * pageSize, start, header))
+
+    if args.output:
+        stk500v2.writeHex(args.output, {page + offset: value for page, data in pages.items() for offset, value in enumerate(data)})
+
+    if args.port:
+        device = stk500v2.Stk500v2(args.port, args.baud)
+        try:
+            info = device.connect()
+            if info and info['appEnd'] != appEnd:
+                print("error: the device ends its application section at 0x%05X" % info['appEnd'])
+                return 1
+            for address in sorted(pages):
+                device.programFlash(address, pages[address])
+            device.leaveProgmode()
+        except stk500v2.Stk500v2Error as error:
+            print("error: %s" % error)
+            return 1
+        finally:
+            device.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""
+Add the image trailer ENABLE_IMAGE_CHECK looks for to an application hex file.
+
+The trailer sits in the last 8 bytes below the end of the application section, or below
+the end of the lower half with --stage for ENABLE_STAGED_UPDATE builds: magic, length and
+the CRC of the first length bytes, gaps in the image counted as erased flash. A bootloader
+with the check only starts an application whose trailer matches, the first time it starts
+after an upload takes the CRC pass, later starts use the result cached in EEPROM.
+
+The trailer page sits far above the image and goes out on its own, the bootloader erases
+every page it writes, so the gap in between does not have to be padded.
+
+    stampHex.py firmware.hex stamped.hex --mcu atmega2560
+    stampHex.py firmware.hex stamped.hex --mcu atmega2560 --stage && stageHex.py stamped.hex staged.hex
+"""
+
+import argparse
+import sys
+
+import deltaUpload
+import stageHex
+import stk500v2
+
+IMAGE_MAGIC = 0xC4EC
+
+FLASH_SIZES = {
+    'atmega328pb': 0x8000,
+    'atmega1280': 0x20000,
+    'atmega1284p': 0x20000,
+    'atmega2560': 0x40000,
+}
+
+
+def imageEnd(mcu, bootSize, stage):
+    """IMAGE_END of the bootloader, APP_END or the size of the staging area"""
+    appEnd = FLASH_SIZES[mcu] - 2 * bootSize
+    if stage:
+        start, header = stageHex.stageLayout(appEnd, deltaUpload.PAGE_SIZES[mcu])
+        return header - start
+    return appEnd
+
+
+def stamp(image, end):
+    """Returns a copy of image with the trailer below end"""
+    trailer = end - 8
+    length = max(image) + 1
+    if length > trailer:
+        raise ValueError("the image runs into the trailer at 0x%05X" % trailer)
+
+    flash = bytearray(b'\xff' * length)
+    for address, value in image.items():
+        flash[address] = value
+    crc = stk500v2.crc16(flash)
+
+    stamped = dict(image)
+    for offset, value in enumerate([IMAGE_MAGIC & 0xFF, IMAGE_MAGIC >> 8,
+                                    length & 0xFF, (length >> 8) & 0xFF, (length >> 16) & 0xFF, length >> 24, crc & 0xFF, crc >> 8]):
+        stamped[trailer + offset] = value
+    return stamped, trailer, length, crc
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('hexFile', help="Intel hex file of the application")
+    parser.add_argument('output', help="Intel hex file with the trailer")
+    parser.add_argument('-m', '--mcu', choices=sorted(FLASH_SIZES), default='atmega2560', help="target (default atmega2560)")
+    parser.add_argument('--boot-size', type=int, choices=(1024, 2048), default=2048, help="BOOTSIZE of the bootloader, 1024 for the REMOVE_SPI_MULTI_SUPPORT targets (default 2048)")
+    parser.add_argument('--stage', action='store_true', help="the bootloader is built with ENABLE_STAGED_UPDATE")
+    args = parser.parse_args()
+
+    try:
+        stamped, trailer, length, crc = stamp(stk500v2.readHex(args.hexFile), imageEnd(args.mcu, args.boot_size, args.stage))
+    except ValueError as error:
+        print("error: %s" % error)
+        return 1
+    stk500v2.writeHex(args.output, stamped)
+    print("%d bytes, CRC 0x%04X, trailer at 0x%05X" % (length, crc, trailer))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,457 @@
+"""
+STK500v2 framing, Intel hex parsing and the bootloader commands used by the host tools.
+
+Needs Python 3 and pyserial.
+"""
+
+import time
+
+import serial
+
+MESSAGE_START = 0x1B
+TOKEN = 0x0E
+RS485_BROADCAST = 0xFF
+
+CMD_SIGN_ON = 0x01
+CMD_SET_PARAMETER = 0x02
+CMD_GET_PARAMETER = 0x03
+CMD_LOAD_ADDRESS = 0x06
+CMD_ENTER_PROGMODE_ISP = 0x10
+CMD_LEAVE_PROGMODE_ISP = 0x11
+CMD_CHIP_ERASE_ISP = 0x12
+CMD_PROGRAM_FLASH_ISP = 0x13
+CMD_READ_FLASH_ISP = 0x14
+CMD_READ_SIGNATURE_ISP = 0x1B
+
+PARAM_HW_VER = 0x90
+
+# vendor commands, see command.h
+CMD_CRC_FLASH = 0x40
+CMD_CRC_PAGES = 0x41
+CMD_PROGRAM_FLASH_LZ = 0x42
+CMD_SESSION_INFO = 0x43
+
+# vendor parameters, see command.h
+PARAM_BAUD_RATE = 0xA2
+PARAM_WINDOW_SIZE = 0xA3
+PARAM_PERF_COUNTERS = 0xC0
+
+# ENABLE_PERF_COUNTERS counters in device order, the last two count timer ticks of 1024 cycles
+PERF_COUNTERS = ('frames', 'checksumErrors', 'pagesErased', 'pagesWritten', 'pagesSkipped', 'spmWait', 'rxIdle')
+PERF_TIMES = ('spmWait', 'rxIdle')
+
+# CMD_SESSION_INFO capability flags, see command.h
+CAPABILITIES = (
+    'doubleBuffer', 'pageCompare', 'streamingProgram', 'streamingRead', 'baudSwitch', 'autobaud',
+    'flashCrc', 'compressedProgram', 'eeprom', 'checksumNack', 'windowedProgram', 'verify',
+    'chipErase', 'bootRequest', 'flashService', 'perfCounters',
+)
+
+# second capability word, CAP2_* in command.h
+CAPABILITIES2 = (
+    'bootPolicy', 'tracePins', 'rs485', 'stagedUpdate', 'imageCheck', 'flowControl', 'multiPageProgram',
+)
+
+# PARAM_BAUD_RATE indices above 0, which is the baudrate the bootloader was built for
+BAUD_RATES = (None, 250000, 500000, 1000000, 2000000)
+
+STATUS_CMD_OK = 0x00
+ANSWER_CKSUM_ERROR = 0xB0
+
+# page CRCs the device answers with one CMD_CRC_PAGES (CRC_PAGES_MAX in stk500boot.c) with the
+# default buffer of 285 bytes, session info replaces it with what the device's buffer holds
+CRC_PAGES_MAX = 141
+
+# largest stream taken by one CMD_PROGRAM_FLASH_LZ, MSG_BUFFER_SIZE - 5, replaced from session info
+LZ_STREAM_MAX = 280
+
+
+class Stk500v2Error(Exception):
+    pass
+
+
+class FrameError(Stk500v2Error):
+    """An answer was lost or damaged on the line, sending again can fix it"""
+    pass
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-CCITT as calculated by _crc_ccitt_update() on the device"""
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            if crc & 1:
+                crc = (crc >> 1) ^ 0x8408
+            else:
+                crc >>= 1
+    return crc
+
+
+def readHex(fileName):
+    """Returns {byte address: value} for all data records of an Intel hex file"""
+    image = {}
+    base = 0
+    with open(fileName) as hexFile:
+        for lineNumber, line in enumerate(hexFile, 1):
+            line = line.strip()
+            if not line:
+                continue
+            if line[0] != ':':
+                raise ValueError("%s:%d: not an Intel hex record" % (fileName, lineNumber))
+            record = bytes.fromhex(line[1:])
+            if sum(record) & 0xFF:
+                raise ValueError("%s:%d: bad checksum" % (fileName, lineNumber))
+            length, offset, recordType = record[0], (record[1] << 8) | record[2], record[3]
+            data = record[4:4 + length]
+            if recordType == 0x00:
+                for i, value in enumerate(data):
+                    image[base + offset + i] = value
+            elif recordType == 0x01:
+                break
+            elif recordType == 0x02:
+                base = ((data[0] << 8) | data[1]) << 4
+            elif recordType == 0x04:
+                base = ((data[0] << 8) | data[1]) << 16
+    return image
+
+
+def imagePages(image, pageSize):
+    """Splits an image into {page address: bytes}, gaps inside a used page are padded with 0xFF"""
+    pages = {}
+    for address, value in image.items():
+        pageAddress = address - (address % pageSize)
+        page = pages.setdefault(pageAddress, bytearray(b'\xff' * pageSize))
+        page[address - pageAddress] = value
+    return pages
+
+
+def writeHex(fileName, image):
+    """Writes {byte address: value} as an Intel hex file, 16 bytes to a record"""
+    with open(fileName, 'w') as hexFile:
+        base = None
+        addresses = sorted(image)
+        i = 0
+        while i < len(addresses):
+            start = addresses[i]
+            data = bytearray()
+            while i < len(addresses) and addresses[i] == start + len(data) and len(data) < 16 and ((start + len(data)) & 0xFFFF or not data):
+                data.append(image[addresses[i]])
+                i += 1
+            if start >> 16 != base:
+                base = start >> 16
+                hexFile.write(hexRecord(0x04, 0, bytes([base >> 8, base & 0xFF])))
+            hexFile.write(hexRecord(0x00, start & 0xFFFF, data))
+        hexFile.write(hexRecord(0x01, 0, b''))
+
+
+def hexRecord(recordType, offset, data):
+    record = bytes([len(data), offset >> 8, offset & 0xFF, recordType]) + bytes(data)
+    return ':%s%02X\n' % (record.hex().upper(), -sum(record) & 0xFF)
+
+
+def loadAddressBody(address):
+    word = address >> 1
+    return bytes([CMD_LOAD_ADDRESS, (word >> 24) & 0xFF, (word >> 16) & 0xFF, (word >> 8) & 0xFF, word & 0xFF])
+
+
+def programFlashBody(data):
+    return bytes([CMD_PROGRAM_FLASH_ISP, len(data) >> 8, len(data) & 0xFF, 0xC1, 0x0A, 0x40, 0x4C, 0x20, 0x00, 0x00]) + bytes(data)
+
+
+class Stk500v2:
+    """
+    node selects the RS-485 framing of ENABLE_RS485, every frame then carries the address of
+    the node after MESSAGE_START. The node can be changed between commands to talk to each
+    bootloader on the bus in turn.
+
+    rtscts hands RTS / CTS to the serial driver for bootloaders built with ENABLE_FLOW_CONTROL,
+    the reset then only pulses DTR.
+    """
+
+    def __init__(self, port, baudrate=115200, timeout=1.0, reset=True, node=None, rtscts=False):
+        self.serial = serial.Serial(port, baudrate, timeout=timeout, rtscts=rtscts)
+        self.baudrate = baudrate
+        self.seqNum = 0
+        self.node = node
+        self.crcPagesMax = CRC_PAGES_MAX
+        self.lzStreamMax = LZ_STREAM_MAX
+        self.nrwwStart = None
+        if reset:
+            self.reset()
+
+    def close(self):
+        self.serial.close()
+
+    def reset(self):
+        """Pulse DTR / RTS the way the Arduino boards reset the target"""
+        self.serial.baudrate = self.baudrate
+        self.serial.dtr = False
+        if not self.serial.rtscts:
+            self.serial.rts = False
+        time.sleep(0.05)
+        self.serial.dtr = True
+        if not self.serial.rtscts:
+            self.serial.rts = True
+        time.sleep(0.05)
+        self.serial.reset_input_buffer()
+
+    def sendMessage(self, body, node=None):
+        self.seqNum = (self.seqNum + 1) & 0xFF
+        frame = bytearray([MESSAGE_START])
+        if node is None:
+            node = self.node
+        if node is not None:
+            frame.append(node)
+        frame += bytes([self.seqNum, len(body) >> 8, len(body) & 0xFF, TOKEN])
+        frame += body
+        checksum = 0
+        for byte in frame:
+            checksum ^= byte
+        frame.append(checksum)
+        self.lastFrame = bytes(frame)
+        self.serial.write(frame)
+
+    def readByte(self):
+        data = self.serial.read(1)
+        if not data:
+            raise FrameError("timeout waiting for an answer")
+        return data[0]
+
+    def readMessage(self):
+        seqNum, body = self.readFrame()
+        # a checksum NACK echoes the sequence number of the damaged frame, which may be the damage
+        if seqNum != self.seqNum and not (body and body[0] == ANSWER_CKSUM_ERROR):
+            raise Stk500v2Error("answer sequence number %d, expected %d" % (seqNum, self.seqNum))
+        return body
+
+    def readFrame(self):
+        """Returns (sequence number, body) of the next answer"""
+        while self.readByte() != MESSAGE_START:
+            pass
+        header = bytearray([MESSAGE_START])
+        if self.node is not None:
+            header.append(self.readByte())
+        for _ in range(4):
+            header.append(self.readByte())
+        if header[-1] != TOKEN:
+            raise FrameError("missing TOKEN in answer")
+        length = (header[-3] << 8) | header[-2]
+        body = self.serial.read(length)
+        if len(body) != length:
+            raise FrameError("timeout in answer body")
+        checksum = 0
+        for byte in header + body:
+            checksum ^= byte
+        if checksum != self.readByte():
+            raise FrameError("bad answer checksum")
+        if self.node is not None and header[1] != self.node:
+            raise FrameError("answer from node %d, expected %d" % (header[1], self.node))
+        return header[-4], body
+
+    def drain(self, quiet=0.05):
+        """Throws away answers still on their way until the line has been quiet for a while"""
+        timeout = self.serial.timeout
+        self.serial.timeout = quiet
+        while self.serial.read(256):
+            pass
+        self.serial.timeout = timeout
+
+    def command(self, body, retries=3):
+        """Sends one command and returns the answer body, which has to report STATUS_CMD_OK"""
+        self.sendMessage(bytes(body))
+        answer = self.readMessage()
+        while answer and answer[0] == ANSWER_CKSUM_ERROR and retries:
+            # the device got a damaged copy, send the same frame again
+            retries -= 1
+            self.serial.write(self.lastFrame)
+            answer = self.readMessage()
+        if len(answer) < 2 or answer[0] != body[0]:
+            raise Stk500v2Error("unexpected answer 0x%02X to command 0x%02X" % (answer[0], body[0]))
+        if answer[1] != STATUS_CMD_OK:
+            raise Stk500v2Error("command 0x%02X failed with status 0x%02X" % (body[0], answer[1]))
+        return answer
+
+    def broadcast(self, body, group=RS485_BROADCAST):
+        """Sends body to every node of group, nobody answers so there is no status either"""
+        self.sendMessage(bytes(body), group)
+        self.serial.flush()
+
+    def signOn(self, attempts=10):
+        for _ in range(attempts):
+            try:
+                answer = self.command([CMD_SIGN_ON])
+                return answer[3:3 + answer[2]].decode('ascii', 'replace')
+            except Stk500v2Error:
+                self.serial.reset_input_buffer()
+        raise Stk500v2Error("no answer to sign on")
+
+    def setParameter(self, parameter, value):
+        self.command([CMD_SET_PARAMETER, parameter, value])
+
+    def getParameter(self, parameter):
+        return self.command([CMD_GET_PARAMETER, parameter])[2]
+
+    def baudRates(self):
+        """Baudrates the device can switch to with ENABLE_BAUD_SWITCH, the current one first"""
+        try:
+            mask = self.getParameter(PARAM_BAUD_RATE)
+        except Stk500v2Error:
+            mask = 1
+        rates = [self.baudrate]
+        rates.extend(BAUD_RATES[index] for index in range(1, len(BAUD_RATES)) if mask & (1 << index))
+        return rates
+
+    def switchBaud(self, baudrate):
+        """Moves both ends to another baudrate, the device falls back if the next message does not arrive cleanly"""
+        index = 0 if baudrate == self.baudrate else BAUD_RATES.index(baudrate)
+        self.setParameter(PARAM_BAUD_RATE, index)
+        self.serial.flush()
+        self.serial.baudrate = baudrate
+        self.getParameter(PARAM_HW_VER)
+
+    def setWindow(self, window):
+        """Asks for a window of program flash frames, returns the one the device can take"""
+        self.setParameter(PARAM_WINDOW_SIZE, window)
+        return self.getParameter(PARAM_WINDOW_SIZE)
+
+    def perfCounters(self, fCpu=16000000):
+        """ENABLE_PERF_COUNTERS counters by name, the wait times in seconds"""
+        counters = {}
+        for index, name in enumerate(PERF_COUNTERS):
+            # the device takes a snapshot of the counter when its low byte is read
+            value = 0
+            for byte in range(4):
+                value |= self.getParameter(PARAM_PERF_COUNTERS + 4 * index + byte) << (8 * byte)
+            counters[name] = value * 1024.0 / fCpu if name in PERF_TIMES else value
+        return counters
+
+    def clearPerfCounters(self):
+        self.setParameter(PARAM_PERF_COUNTERS, 0)
+
+    def sessionInfo(self):
+        """Signature, fuses, sizes and build options in one message"""
+        answer = self.command([CMD_SESSION_INFO])
+        caps = (answer[20] << 8) | answer[21]
+        caps2 = (answer[30] << 8) | answer[31] if len(answer) >= 32 else 0
+        if len(answer) >= 24:
+            bufferSize = (answer[22] << 8) | answer[23]
+            self.crcPagesMax = min(255, (bufferSize - 2) // 2)
+            self.lzStreamMax = bufferSize - 5
+        if len(answer) >= 30:
+            self.nrwwStart = int.from_bytes(answer[26:30], 'big')
+        return {
+            'signature': bytes(answer[2:5]),
+            'lowFuse': answer[5],
+            'highFuse': answer[6],
+            'extendedFuse': answer[7],
+            'lockBits': answer[8],
+            'pageSize': (answer[9] << 8) | answer[10],
+            'appEnd': int.from_bytes(answer[11:15], 'big'),
+            'hwVersion': answer[15],
+            'swVersion': (answer[16], answer[17]),
+            'build': (answer[18] << 8) | answer[19],
+            'capabilities': [name for bit, name in enumerate(CAPABILITIES) if caps & (1 << bit)] +
+                            [name for bit, name in enumerate(CAPABILITIES2) if caps2 & (1 << bit)],
+            'bufferSize': (answer[22] << 8) | answer[23] if len(answer) >= 24 else None,
+            'blockSize': (answer[24] << 8) | answer[25] if len(answer) >= 26 else None,
+            'nrwwStart': self.nrwwStart,
+        }
+
+    def connect(self, attempts=10):
+        """
+        Gets in touch with the bootloader in one round trip when it answers CMD_SESSION_INFO,
+        returns its session info or None after falling back to sign on and enter progmode
+        """
+        for _ in range(attempts):
+            try:
+                return self.sessionInfo()
+            except FrameError:
+                self.serial.reset_input_buffer()
+            except Stk500v2Error:
+                break
+        self.signOn(attempts)
+        self.enterProgmode()
+        return None
+
+    def chipErase(self):
+        self.command([CMD_CHIP_ERASE_ISP, 10, 0, 0xAC, 0x80, 0x00, 0x00])
+
+    def enterProgmode(self):
+        self.command([CMD_ENTER_PROGMODE_ISP] + [0] * 11)
+
+    def leaveProgmode(self):
+        self.command([CMD_LEAVE_PROGMODE_ISP, 1, 1])
+
+    def loadAddress(self, address):
+        self.command(loadAddressBody(address))
+
+    def programFlash(self, address, data):
+        self.loadAddress(address)
+        self.command(programFlashBody(data))
+
+    def programFlashBlocks(self, address, data, blockSize):
+        """
+        Programs data from address on in blocks of blockSize bytes, the address is only loaded
+        once. Blocks of several pages need ENABLE_MULTI_PAGE_PROGRAM.
+        """
+        self.loadAddress(address)
+        for offset in range(0, len(data), blockSize):
+            self.command(programFlashBody(data[offset:offset + blockSize]))
+
+    def programFlashWindowed(self, address, data, pageSize, window, retries=8):
+        """
+        Programs data from address on with up to window frames unanswered. One answer covers
+        every frame up to its sequence number. After a lost frame the device drops the rest, so
+        everything from the first unanswered page is sent again. The device does not receive
+        while it writes a page from nrwwStart on (session info), without RTS / CTS those pages
+        go out one at a time.
+        """
+        nrwwStart = None if self.serial.rtscts else self.nrwwStart
+        pages = [(address + offset, data[offset:offset + pageSize]) for offset in range(0, len(data), pageSize)]
+        done = 0
+        while done < len(pages):
+            inflight = []
+            sent = done
+            try:
+                self.loadAddress(pages[done][0])
+                while done < len(pages):
+                    while sent < len(pages) and len(inflight) < window:
+                        pageAddress, page = pages[sent]
+                        if inflight and nrwwStart is not None and max(pageAddress, pages[sent - 1][0]) >= nrwwStart:
+                            break
+                        self.sendMessage(programFlashBody(page))
+                        inflight.append(self.seqNum)
+                        sent += 1
+                    seqNum, answer = self.readFrame()
+                    if answer[0] != CMD_PROGRAM_FLASH_ISP or seqNum not in inflight:
+                        raise FrameError("frame after page 0x%05X lost" % pages[done][0])
+                    if answer[1] != STATUS_CMD_OK:
+                        raise Stk500v2Error("program flash failed with status 0x%02X" % answer[1])
+                    acked = inflight.index(seqNum) + 1
+                    done += acked
+                    del inflight[:acked]
+            except FrameError:
+                if not retries:
+                    raise
+                retries -= 1
+                self.drain()
+
+    def programFlashCompressed(self, size, stream):
+        """Inflates stream into size bytes from the current address on, which moves on by size"""
+        self.command(bytes([CMD_PROGRAM_FLASH_LZ, size >> 8, size & 0xFF, len(stream) >> 8, len(stream) & 0xFF]) + bytes(stream))
+
+    def readFlash(self, address, length):
+        self.loadAddress(address)
+        answer = self.command([CMD_READ_FLASH_ISP, length >> 8, length & 0xFF, 0x20])
+        return answer[2:2 + length]
+
+    def crcFlash(self, address, length):
+        self.loadAddress(address)
+        answer = self.command([CMD_CRC_FLASH, (length >> 24) & 0xFF, (length >> 16) & 0xFF, (length >> 8) & 0xFF, length & 0xFF])
+        return (answer[2] << 8) | answer[3]
+
+    def crcPages(self, address, count):
+        """CRC of count pages from address on, the device may answer with fewer"""
+        self.loadAddress(address)
+        answer = self.command([CMD_CRC_PAGES, min(count, self.crcPagesMax)])
+        return [(answer[i] << 8) | answer[i + 1] for i in range(2, len(answer) - 1, 2)]
@@ -1,5 +1,9 @@
 #include <avr/wdt.h>
 
+// BOOT_REQUEST_KEY and BOOT_REQUEST_ADDRESS of a bootloader built with ENABLE_BOOT_REQUEST
+#define BOOT_REQUEST_KEY 0xB007
+#define BOOT_REQUEST_ADDRESS ( RAMEND - 1 )
+
 uint8_t resetSource __attribute__ ((section(".noinit")));
 
 void resetFlagsInit(void) __attribute__ ((naked))
@@ -26,6 +30,9 @@ void setup() {
 // the loop function runs over and over again forever
 void loop() {
   //wdt_reset();
+  if (Serial.available() && Serial.read() == 'b') {
+    enterBootloader();
+  }
   Serial.println(i++);
   Serial.println(millis());
   digitalWrite(LED_BUILTIN, HIGH);   // turn the LED on (HIGH is the voltage level)
@@ -34,6 +41,17 @@ void loop() {
   delay(1000);                       // wait for a second
 }
 
+// leave the key for the bootloader and let the watchdog reset the board
+void enterBootloader(void)
+{
+  Serial.println(F("Entering bootloader"));
+  Serial.flush();
+  cli();
+  *(volatile uint16_t *)BOOT_REQUEST_ADDRESS = BOOT_REQUEST_KEY;
+  wdt_enable(WDTO_15MS);
+  for (;;);
+}
+
 void reset_source(void)
 {
   // Check source of reset
@@ -31,6 +31,34 @@ NOTES:
 //#define REMOVE_READ_FUSE_BIT_SUPPORT													// disable reading lock and fuse bits
 //#define REMOVE_WATCHDOG_SUPPORT																// disable the clearing of the wdt bits
 //#define REMOVE_READ_SIGNATURE_SUPPORT													// disable the read signature support
+//#define ENABLE_DOUBLE_BUFFER                                  // ack program flash while the page is still being written
+//#define ENABLE_PAGE_COMPARE                                   // skip pages already holding the same data
+//#define ENABLE_STREAMING_PROGRAM                              // fill the page buffer while program flash is received
+//#define ENABLE_STREAMING_READ                                 // send read flash answers straight from flash
+//#define ENABLE_BAUD_SWITCH                                    // let the host switch to a faster baudrate after sign on
+//#define ENABLE_AUTOBAUD                                       // take the baudrate from the first MESSAGE_START
+//#define ENABLE_BOOT_POLICY                                    // pick the boot window from the reset cause
+//#define ENABLE_FLASH_CRC                                      // CRC of a flash range calculated on the device
+//#define ENABLE_COMPRESSED_PROGRAM                             // program flash from an LZ compressed stream
+//#define ENABLE_EEPROM                                         // read and program the EEPROM, writes run in the background
+//#define ENABLE_CHECKSUM_NACK                                  // answer a damaged message with ANSWER_CKSUM_ERROR
+//#define ENABLE_WINDOWED_PROGRAM                               // take program flash frames back to back with cumulative answers
+//#define ENABLE_SESSION_INFO                                   // answer signature, fuses, sizes and options in one message
+//#define ENABLE_VERIFY                                         // read each page back before answering, not with ENABLE_DOUBLE_BUFFER
+//#define ENABLE_CHIP_ERASE                                     // erase the application section ahead of programming
+//#define ENABLE_BOOT_REQUEST                                   // stay in the bootloader when the application left BOOT_REQUEST_KEY
+//#define ENABLE_FLASH_SERVICE                                  // page erase, fill and write for the application, needs FLASH_SERVICE_ADDRESS in the Makefile
+//#define ENABLE_PERF_COUNTERS                                  // count frames, errors, pages and wait times, read with CMD_GET_PARAMETER
+//#define ENABLE_TRACE_PINS                                     // raise a port pin per phase for a logic analyzer, see TRACE_PORT
+//#define ENABLE_RS485                                          // node addressed frames on a RS-485 bus, group frames are never answered
+//#define ENABLE_STAGED_UPDATE                                  // copy an image staged in the upper half of flash down at reset
+//#define ENABLE_IMAGE_CHECK                                    // start only an application whose trailer CRC matches, see IMAGE_TRAILER
+//#define ENABLE_FLOW_CONTROL                                   // RTS / CTS hardware flow control with a receive ring, see FLOW_RTS_PORT
+//#define ENABLE_MULTI_PAGE_PROGRAM                             // take program flash blocks of up to PROGRAM_BLOCK_PAGES pages
+
+#if defined(ENABLE_FLASH_CRC) || defined(ENABLE_STAGED_UPDATE) || defined(ENABLE_IMAGE_CHECK)
+	#include	<util/crc16.h>
+#endif
 
 #ifndef EEWE
 	#define EEWE    1
@@ -53,7 +81,27 @@ NOTES:
 	#define BAUDRATE 115200U
 #endif
 
-#define BOOT_TIMEOUT 500000U   // should be about 1 second
+/*
+ * Boot window in ms, set per target in the Makefile
+ */
+#ifndef BOOT_TIMEOUT_MS
+	#define BOOT_TIMEOUT_MS 1000U
+#endif
+#ifndef BOOT_TIMEOUT_SHORT_MS
+	#define BOOT_TIMEOUT_SHORT_MS 100U
+#endif
+#define BAUD_CONFIRM_TIMEOUT_MS 200U
+
+/*
+ * Timer 0 runs in CTC mode with one compare match per ms while waiting for the host
+ */
+#if ( F_CPU / 64UL / 1000UL ) <= 256UL
+	#define BOOT_TIMER_PRESCALER	( ( 1 << CS01 ) | ( 1 << CS00 ) )		// F_CPU / 64
+	#define BOOT_TIMER_TOP				( F_CPU / 64UL / 1000UL - 1UL )
+#else
+	#define BOOT_TIMER_PRESCALER	( 1 << CS02 )											// F_CPU / 256
+	#define BOOT_TIMER_TOP				( F_CPU / 256UL / 1000UL - 1UL )
+#endif
 
 /*
  *  Enable (1) or disable (0) USART double speed operation
@@ -93,6 +141,198 @@ NOTES:
 
 #define APP_END  ( FLASHEND - ( 2U * BOOTSIZE ) + 1U )
 
+/*
+ * Largest program flash block, one page unless several pages may come in one message
+ */
+#ifdef ENABLE_MULTI_PAGE_PROGRAM
+	#ifndef PROGRAM_BLOCK_PAGES
+		#if (RAMEND > 0x1000)
+			#define PROGRAM_BLOCK_PAGES 4U
+		#else
+			#define PROGRAM_BLOCK_PAGES 2U
+		#endif
+	#endif
+	#define PROGRAM_BLOCK_SIZE ( PROGRAM_BLOCK_PAGES * SPM_PAGESIZE )
+#else
+	#define PROGRAM_BLOCK_SIZE SPM_PAGESIZE
+#endif
+
+/*
+ * Size of the message buffer, holds the largest message received or answered
+ */
+#ifndef MSG_BUFFER_SIZE
+	#if defined(ENABLE_STREAMING_PROGRAM) && defined(ENABLE_STREAMING_READ)
+		#define MSG_BUFFER_SIZE 32U		// no flash data passes through the buffer
+	#elif defined(ENABLE_MULTI_PAGE_PROGRAM)
+		#define MSG_BUFFER_SIZE ( PROGRAM_BLOCK_SIZE + 29U )
+	#else
+		#define MSG_BUFFER_SIZE 285U
+	#endif
+#endif
+
+/*
+ * Longest message body taken, a streamed program flash frame passes its page data by the buffer
+ */
+#if defined(ENABLE_STREAMING_PROGRAM) && ( ( SPM_PAGESIZE + 10U ) > MSG_BUFFER_SIZE )
+	#define MSG_LENGTH_MAX ( SPM_PAGESIZE + 10U )
+#else
+	#define MSG_LENGTH_MAX MSG_BUFFER_SIZE
+#endif
+
+/*
+ * Key the application writes to the top two bytes of RAM before a watchdog reset to ask for
+ * the bootloader. __bootRequest() moves it to a flag before the stack is used. A fixed address
+ * is used rather than a .noinit variable, the bootloader and the application are linked apart.
+ */
+#ifndef BOOT_REQUEST_KEY
+	#define BOOT_REQUEST_KEY 0xB007
+#endif
+#define BOOT_REQUEST_ADDRESS	( RAMEND - 1 )
+#define BOOT_REQUEST_FLAG		GPIOR0
+
+/*
+ * Polled receive ring for the windowed mode and the flow control, a power of two. The window
+ * is what the ring holds while one program flash frame sits in msgBuffer. Nothing is polled
+ * while SPM on the NRWW section halts the CPU, without flow control the host sends the pages
+ * from NRWW_START on one at a time, session info reports where that is.
+ */
+#if defined(ENABLE_WINDOWED_PROGRAM) || defined(ENABLE_FLOW_CONTROL)
+	#define	RX_RING
+#endif
+#ifndef RX_RING_SIZE
+	#ifndef ENABLE_WINDOWED_PROGRAM
+		#define RX_RING_SIZE 64U
+	#elif (RAMEND > 0x1000)
+		#define RX_RING_SIZE 2048U
+	#else
+		#define RX_RING_SIZE 512U
+	#endif
+#endif
+#define WINDOW_MAX ( ( RX_RING_SIZE / ( PROGRAM_BLOCK_SIZE + 16 ) ) + 1 )
+
+/*
+ * RTS goes off once less than RX_RING_HEADROOM bytes of the ring are free, which covers the
+ * bytes the host adapter still sends, and back on once twice that is free
+ */
+#ifndef RX_RING_HEADROOM
+	#define RX_RING_HEADROOM 16U
+#endif
+
+/*
+ * A staged update lives in the upper half of the application section, the application is
+ * limited to the lower half. The last page below APP_END holds the header, little endian:
+ * magic, version (2 bytes each), length (4 bytes) and the CRC of the staged bytes (2 bytes).
+ * The header has to be written last, it is erased once the image has been copied down.
+ */
+#define	STAGE_START			( ( APP_END / 2 ) & ~( (uint32_t)SPM_PAGESIZE - 1 ) )
+#define	STAGE_HEADER		( APP_END - SPM_PAGESIZE )
+#define	STAGE_SIZE			( STAGE_HEADER - STAGE_START )
+#define	STAGE_MAGIC			0x5A17
+
+/*
+ * The application ends with a trailer of magic (2 bytes), length (4 bytes) and the CRC of
+ * the first length bytes of flash (2 bytes), little endian, in the last 8 bytes below
+ * IMAGE_END. A good check is cached in IMAGE_CHECK_EEPROM until flash is written again.
+ */
+#ifdef ENABLE_STAGED_UPDATE
+	#define	IMAGE_END				STAGE_SIZE		// the image has to fit the staging area as well
+#else
+	#define	IMAGE_END				APP_END
+#endif
+#define	IMAGE_TRAILER				( IMAGE_END - 8 )
+#define	IMAGE_MAGIC					0xC4EC
+#define	IMAGE_VERIFIED			0xA5
+#ifndef IMAGE_CHECK_EEPROM
+	#define	IMAGE_CHECK_EEPROM	( E2END - 2 )
+#endif
+
+/*
+ * Page CRCs answered by one CMD_CRC_PAGES, two bytes each after the command and status
+ */
+#if ( ( MSG_BUFFER_SIZE - 2 ) / 2 ) > 255
+	#define CRC_PAGES_MAX 255U		// the count is a single byte
+#else
+	#define CRC_PAGES_MAX ( ( MSG_BUFFER_SIZE - 2 ) / 2 )
+#endif
+
+/*
+ * The streamed page data lives only in the SPM page buffer, there is nothing left to compare
+ * against and the page buffer can not be refilled while a page is still being written
+ */
+#if defined(ENABLE_STREAMING_PROGRAM) && ( defined(ENABLE_DOUBLE_BUFFER) || defined(ENABLE_PAGE_COMPARE) )
+	#error "ENABLE_STREAMING_PROGRAM can not be combined with ENABLE_DOUBLE_BUFFER or ENABLE_PAGE_COMPARE"
+#endif
+#if defined(ENABLE_STREAMING_PROGRAM) && defined(ENABLE_VERIFY)
+	#error "ENABLE_STREAMING_PROGRAM leaves no copy of the page to verify against"
+#endif
+
+/*
+ * The page buffer is filled between received bytes, no erase can run in the background then
+ */
+#if defined(ENABLE_STREAMING_PROGRAM) && defined(ENABLE_CHIP_ERASE)
+	#error "ENABLE_STREAMING_PROGRAM can not be combined with ENABLE_CHIP_ERASE"
+#endif
+
+/*
+ * An EEPROM write started while the page buffer is loaded throws the loaded data away
+ */
+#if defined(ENABLE_STREAMING_PROGRAM) && defined(ENABLE_EEPROM)
+	#error "ENABLE_STREAMING_PROGRAM can not be combined with ENABLE_EEPROM"
+#endif
+
+/*
+ * The double buffered programDevice() answers before the page is written and reports its word sum
+ * check with the next page, there is no read back before the answer
+ */
+#if defined(ENABLE_DOUBLE_BUFFER) && defined(ENABLE_VERIFY)
+	#error "ENABLE_DOUBLE_BUFFER can not be combined with ENABLE_VERIFY"
+#endif
+
+/*
+ * The decompressor only fits the 2048 byte boot section and hands whole pages to programDevice()
+ */
+#if defined(ENABLE_COMPRESSED_PROGRAM) && ( defined(REMOVE_SPI_MULTI_SUPPORT) || defined(ENABLE_STREAMING_PROGRAM) )
+	#error "ENABLE_COMPRESSED_PROGRAM needs SPI multi support and can not be combined with ENABLE_STREAMING_PROGRAM"
+#endif
+
+/*
+ * The streamed page data goes to the page buffer of a single page
+ */
+#if defined(ENABLE_MULTI_PAGE_PROGRAM) && defined(ENABLE_STREAMING_PROGRAM)
+	#error "ENABLE_MULTI_PAGE_PROGRAM can not be combined with ENABLE_STREAMING_PROGRAM"
+#endif
+
+/*
+ * A RS-485 bus is half duplex and other nodes' frames must not touch the page buffer
+ */
+#if defined(ENABLE_RS485) && ( defined(ENABLE_STREAMING_PROGRAM) || defined(ENABLE_WINDOWED_PROGRAM) )
+	#error "ENABLE_RS485 can not be combined with ENABLE_STREAMING_PROGRAM or ENABLE_WINDOWED_PROGRAM"
+#endif
+
+/*
+ * The staged image is copied with the 2048 byte boot section only
+ */
+#if defined(ENABLE_STAGED_UPDATE) && defined(REMOVE_SPI_MULTI_SUPPORT)
+	#error "ENABLE_STAGED_UPDATE needs SPI multi support"
+#endif
+
+/*
+ * Start of the No-Read-While-Write section, the CPU is halted while a page in here is erased or written.
+ * The NRWW section is fixed by the part and is larger than the boot section, the pages below APP_END
+ * from here on stall the CPU too
+ */
+#ifndef NRWW_START
+	#if defined(__AVR_ATmega2560__)
+		#define NRWW_START 0x3E000UL
+	#elif defined(__AVR_ATmega1280__) || defined(__AVR_ATmega1284P__)
+		#define NRWW_START 0x1E000UL
+	#elif defined(__AVR_ATmega328PB__) || defined(__AVR_ATmega328P__)
+		#define NRWW_START 0x7000U
+	#else
+		#define NRWW_START APP_END
+	#endif
+#endif
+
 /*
  * Signature bytes are not available in avr-gcc io_xxx.h
  */
@@ -116,9 +356,11 @@ NOTES:
 	#define	UART_ENABLE_TRANSMITTER	TXEN0
 	#define	UART_ENABLE_RECEIVER		RXEN0
 	#define	UART_TRANSMIT_COMPLETE	TXC0
+	#define	UART_DATA_EMPTY					UDRE0
 	#define	UART_RECEIVE_COMPLETE		RXC0
 	#define	UART_DATA_REG						UDR0
 	#define	UART_DOUBLE_SPEED				U2X0
+	#define	UART_FRAME_ERROR				FE0
 #elif defined(__AVR_ATmega328PB__)
 	#define	UART_BAUD_RATE_LOW			UBRR0L
 	#define	UART_STATUS_REG					UCSR0A
@@ -126,13 +368,152 @@ NOTES:
 	#define	UART_ENABLE_TRANSMITTER	TXEN0
 	#define	UART_ENABLE_RECEIVER		RXEN0
 	#define	UART_TRANSMIT_COMPLETE	TXC0
+	#define	UART_DATA_EMPTY					UDRE0
 	#define	UART_RECEIVE_COMPLETE		RXC0
 	#define	UART_DATA_REG						UDR0
 	#define	UART_DOUBLE_SPEED				U2X0
+	#define	UART_FRAME_ERROR				FE0
 #else
 	#error "no UART definition for MCU available"
 #endif
 
+/*
+ * RXD0 pin, sampled by the autobaud detection while the USART is still off
+ */
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+	#define	UART_RX_PIN							PINE
+	#define	UART_RX_BIT							PE0
+#else
+	#define	UART_RX_PIN							PIND
+	#define	UART_RX_BIT							PD0
+#endif
+
+#ifdef ENABLE_RS485
+/*
+ * Every frame carries a node address after MESSAGE_START, the answer carries the node's own.
+ * The node address is kept in the last EEPROM byte (RS485_NODE while that is erased) and the
+ * group address in the one before. Frames to the group or to RS485_BROADCAST are processed by
+ * every node in it and never answered. DE of the transceiver is driven high while answering.
+ */
+#ifndef RS485_NODE
+	#define	RS485_NODE							1
+#endif
+#define	RS485_BROADCAST					0xFF
+#define	RS485_NODE_EEPROM				E2END
+#define	RS485_GROUP_EEPROM			( E2END - 1 )
+
+#ifndef RS485_DE_PORT
+	#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+		#define	RS485_DE_PORT					PORTE
+		#define	RS485_DE_DDR					DDRE
+		#define	RS485_DE_BIT					PE4		// D2 on the Arduino Mega
+	#else
+		#define	RS485_DE_PORT					PORTD
+		#define	RS485_DE_DDR					DDRD
+		#define	RS485_DE_BIT					PD2
+	#endif
+#endif
+#endif
+
+#ifdef ENABLE_FLOW_CONTROL
+/*
+ * RTS is an output to the CTS input of the host adapter, CTS an input from its RTS output.
+ * Both are active low, CTS has to be wired or nothing is sent. Set per target in the Makefile.
+ */
+#ifndef FLOW_RTS_PORT
+	#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+		#define	FLOW_RTS_PORT					PORTE
+		#define	FLOW_RTS_DDR					DDRE
+		#define	FLOW_RTS_BIT					PE5		// D3 on the Arduino Mega
+		#define	FLOW_CTS_PIN					PING
+		#define	FLOW_CTS_BIT					PG5		// D4
+	#else
+		#define	FLOW_RTS_PORT					PORTD
+		#define	FLOW_RTS_DDR					DDRD
+		#define	FLOW_RTS_BIT					PD6
+		#define	FLOW_CTS_PIN					PIND
+		#define	FLOW_CTS_BIT					PD7
+	#endif
+#endif
+
+/*
+ * Polls after RTS went up before an SPM halts the CPU, about ten bytes at the built baudrate,
+ * the host adapter may still send what it has started
+ */
+#define	FLOW_HOLD_LOOPS	( ( F_CPU / BAUDRATE ) * 8 )
+#endif
+
+#ifdef ENABLE_TRACE_PINS
+/*
+ * Each pin is high while its phase runs: receiving a message, erasing, filling and writing a
+ * page, reading flash and sending the answer. The defaults use pins that are free on the
+ * Arduino boards, A0 - A5 on the 2560 and 328PB.
+ */
+#ifndef TRACE_PORT
+	#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+		#define	TRACE_PORT					PORTF
+		#define	TRACE_DDR						DDRF
+	#elif defined(__AVR_ATmega1284P__)
+		#define	TRACE_PORT					PORTA
+		#define	TRACE_DDR						DDRA
+	#else
+		#define	TRACE_PORT					PORTC
+		#define	TRACE_DDR						DDRC
+	#endif
+#endif
+#ifndef TRACE_RECEIVE
+	#define	TRACE_RECEIVE					0
+	#define	TRACE_ERASE						1
+	#define	TRACE_FILL						2
+	#define	TRACE_WRITE						3
+	#define	TRACE_READ						4
+	#define	TRACE_TRANSMIT				5
+#endif
+#define	TRACE_MASK	( ( 1 << TRACE_RECEIVE ) | ( 1 << TRACE_ERASE ) | ( 1 << TRACE_FILL ) | ( 1 << TRACE_WRITE ) | ( 1 << TRACE_READ ) | ( 1 << TRACE_TRANSMIT ) )
+
+	#define	traceBegin(pin)	TRACE_PORT	|=	( 1 << (pin) )
+	#define	traceEnd(pin)		TRACE_PORT	&=	~( 1 << (pin) )
+#else
+	#define	traceBegin(pin)
+	#define	traceEnd(pin)
+#endif
+
+#ifdef ENABLE_BOOT_POLICY
+/*
+ * Boot window used after each reset cause, BOOT_APP starts the application straight away
+ * (the full window is used when there is none), BOOT_SHORT waits BOOT_TIMEOUT_SHORT_MS and
+ * BOOT_FULL waits BOOT_TIMEOUT_MS for the host. Override from the Makefile with MICRO_DEFS.
+ */
+#define	BOOT_APP		0
+#define	BOOT_SHORT		1
+#define	BOOT_FULL		2
+
+#ifndef BOOT_POLICY_POWER_ON
+	#define BOOT_POLICY_POWER_ON	BOOT_FULL
+#endif
+#ifndef BOOT_POLICY_EXTERNAL
+	#define BOOT_POLICY_EXTERNAL	BOOT_FULL
+#endif
+#ifndef BOOT_POLICY_BROWN_OUT
+	#define BOOT_POLICY_BROWN_OUT	BOOT_FULL
+#endif
+#ifndef BOOT_POLICY_WATCHDOG
+	#define BOOT_POLICY_WATCHDOG	BOOT_APP
+#endif
+#ifndef BOOT_POLICY_JTAG
+	#define BOOT_POLICY_JTAG		BOOT_FULL
+#endif
+
+/*
+ * Optional strap pin, held low at reset it keeps the bootloader waiting for the host whatever
+ * the reset cause, e.g. -DBOOT_STRAP_PORT=PORTB -DBOOT_STRAP_PIN=PINB -DBOOT_STRAP_BIT=PB4
+ */
+#endif
+
+#if defined(ENABLE_AUTOBAUD) && !UART_BAUDRATE_DOUBLE_SPEED
+	#error "ENABLE_AUTOBAUD calculates the UBRR for double speed operation"
+#endif
+
 /*
  * Macro to calculate UBBR from XTAL and baudrate
  */
@@ -142,6 +523,34 @@ NOTES:
 	#define UART_BAUD_SELECT(baudRate, xtalCpu) (((float)(xtalCpu))/(((float)(baudRate))*16.0)-1.0+0.5)
 #endif
 
+#ifdef ENABLE_BAUD_SWITCH
+/*
+ * Baudrates selectable through PARAM_BAUD_RATE, index 0 is BAUDRATE
+ */
+#define	BAUD_RATE_1		250000UL
+#define	BAUD_RATE_2		500000UL
+#define	BAUD_RATE_3		1000000UL
+#define	BAUD_RATE_4		2000000UL
+#define	BAUD_NONE		0xFF
+
+/*
+ * Pick the UBRR / U2X pair with the smallest error for a baudrate at F_CPU,
+ * these all fold to constants so nothing is calculated on the device
+ */
+#define	BAUD_DIVIDER(baudRate, div)	((uint16_t)(((float)F_CPU) / (((float)(baudRate)) * (div)) + 0.5))
+#define	BAUD_DEVIATION(baudRate, div)	( BAUD_DIVIDER(baudRate, div) ? ( ((float)F_CPU) / ((div) * BAUD_DIVIDER(baudRate, div)) - (baudRate) ) : (float)(baudRate) )
+#define	BAUD_ERROR(baudRate, div)	( BAUD_DEVIATION(baudRate, div) < 0 ? -BAUD_DEVIATION(baudRate, div) : BAUD_DEVIATION(baudRate, div) )
+#define	BAUD_DOUBLE(baudRate)		( BAUD_ERROR(baudRate, 8.0) < BAUD_ERROR(baudRate, 16.0) )
+#define	BAUD_UBRR(baudRate)			( ( BAUD_DOUBLE(baudRate) ? BAUD_DIVIDER(baudRate, 8.0) : BAUD_DIVIDER(baudRate, 16.0) ) - 1 )
+#define	BAUD_VALID(baudRate)		( ( BAUD_DOUBLE(baudRate) ? BAUD_ERROR(baudRate, 8.0) : BAUD_ERROR(baudRate, 16.0) ) <= ( (baudRate) * 0.02 ) )
+
+/*
+ * Bit mask of the baudrates within 2% at F_CPU, reported by getParameter(PARAM_BAUD_RATE)
+ */
+#define	BAUD_RATES_SUPPORTED	( 1 | ( BAUD_VALID(BAUD_RATE_1) << 1 ) | ( BAUD_VALID(BAUD_RATE_2) << 2 ) | \
+									( BAUD_VALID(BAUD_RATE_3) << 3 ) | ( BAUD_VALID(BAUD_RATE_4) << 4 ) )
+#endif
+
 
 /*
  * States used in the receive state machine
@@ -154,13 +563,156 @@ NOTES:
 #define ST_GET_DATA			5
 #define	ST_GET_CHECK		6
 #define	ST_PROCESS			7
+#ifdef ENABLE_RS485
+	#define	ST_GET_NODE			8
+	#define	ST_AFTER_START	ST_GET_NODE
+#else
+	#define	ST_AFTER_START	ST_GET_SEQ_NUM
+#endif
+
+/*
+ * Read a word from flash, devices with more than 64K need ELPM
+ */
+#if (FLASHEND > 0x10000)
+	#define readFlashWord(address)	pgm_read_word_far(address)
+	#define readFlashByte(address)	pgm_read_byte_far(address)
+#else
+	#define readFlashWord(address)	pgm_read_word_near(address)
+	#define readFlashByte(address)	pgm_read_byte_near(address)
+#endif
+
+#ifdef ENABLE_DOUBLE_BUFFER
+/*
+ * States of the page left in the SPM unit by programDevice()
+ */
+#define	PAGE_IDLE			0
+#define	PAGE_ERASING		1
+#define	PAGE_WRITING		2
+
+/*
+ * The bootloader is linked without the crt startup code, so .bss is not cleared,
+ * these are initialised at the top of main()
+ */
+static uint8_t	pageState;
+static uint8_t	pageStatus;		// result of the last committed page, reported with the next program command
+static uint32_t	pagePending;	// location and word sum of the data sitting in the page buffer
+static uint16_t	pageSize;
+static uint16_t	pageSum;
+#endif
+
+#ifdef RX_RING
+/*
+ * Wait for the SPM unit while the receive ring keeps taking bytes
+ */
+	#define	spmBusyPoll()	while (boot_spm_busy()) pollSerial()
+#else
+	#define	spmBusyPoll()	boot_spm_busy_wait()
+#endif
 
+#ifdef ENABLE_PERF_COUNTERS
+/*
+ * Counters read with CMD_GET_PARAMETER from PARAM_PERF_COUNTERS on, four bytes each LSB first.
+ * The wait times are in ticks of timer 1 running at F_CPU / 1024.
+ */
+#define	PERF_FRAMES					0		// messages received, damaged ones included
+#define	PERF_CHECKSUM_ERRORS		1
+#define	PERF_PAGES_ERASED			2
+#define	PERF_PAGES_WRITTEN			3
+#define	PERF_PAGES_SKIPPED			4
+#define	PERF_SPM_WAIT				5		// time stalled waiting for the SPM unit
+#define	PERF_RX_IDLE				6		// time waiting for the next message
+#define	PERF_COUNTERS				7
+
+#define	PERF_TIMER_PRESCALER		( ( 1 << CS12 ) | ( 1 << CS10 ) )
+
+static uint32_t	perfCounters[PERF_COUNTERS];
+static uint32_t	perfLatch;		// counter being read, taken when its low byte is read
+
+	#define	perfCount(n)	perfCounters[n]++
+	#define	spmBusyWait()	perfSpmBusyWait()
+#else
+	#define	perfCount(n)
+	#define	spmBusyWait()	spmBusyPoll()
+#endif
+
+/*
+ * Result of comparing a page with the data about to be written
+ */
+#define	PAGE_DIFFERS		1
+#define	PAGE_NOT_BLANK		2
+
+#ifdef ENABLE_PAGE_COMPARE
+static uint16_t	skippedPages;	// pages left untouched because flash already held the data
+#endif
+
+#ifdef ENABLE_CHIP_ERASE
+static uint32_t	eraseAhead;		// after a chip erase every page below is clean, APP_END when none is running
+static uint32_t	eraseClean;		// pages from here on are clean since the chip erase, APP_END without one
+#endif
+
+#ifdef RX_RING
+static uint8_t	rxRing[RX_RING_SIZE];
+static uint16_t	rxHead;
+static uint16_t	rxTail;
+#endif
+
+#ifdef ENABLE_WINDOWED_PROGRAM
+static uint8_t	windowSize;		// unanswered program flash frames allowed, 0 answers every frame
+static uint8_t	windowSeq;		// sequence number of the next frame to program
+static uint8_t	windowPending;	// frames programmed since the last answer
+#endif
+
+#ifdef ENABLE_RS485
+static uint8_t	rs485Node;
+static uint8_t	rs485Group;
+static uint8_t	frameNode;		// node address of the last frame received
+	// a frame for another node is read to its end but not stored
+	#define	frameForeign()	( ( frameNode != rs485Node ) && ( frameNode != rs485Group ) && ( frameNode != RS485_BROADCAST ) )
+#else
+	#define	frameForeign()	0
+#endif
+
+#ifdef ENABLE_EEPROM
+/*
+ * EEPROM bytes waiting to be written by serviceEeprom(), the uint8_t indices wrap with the 256 byte queue
+ */
+static uint8_t	eepromQueue[256];
+static uint8_t	eepromHead;
+static uint8_t	eepromTail;
+static uint16_t	eepromAddress;	// EEPROM address of the byte at eepromTail
+#endif
 
 /*
  * since this bootloader is not linked against the avr-gcc crt1 functions,
  * to reduce the code size, we need to provide our own initialization
  */
 
+#ifdef ENABLE_BOOT_REQUEST
+
+void __bootRequest (void) __attribute__ ((naked)) __attribute__ ((section (".init8")));
+
+void __bootRequest(void)
+{
+	asm volatile (
+		"clr	__zero_reg__		\n\t"
+		"lds	r24, %[key]			\n\t"
+		"lds	r25, %[key] + 1		\n\t"
+		"sts	%[key], __zero_reg__	\n\t"		// the next reset starts the application again
+		"sts	%[key] + 1, __zero_reg__	\n\t"
+		"out	%[flag], __zero_reg__	\n\t"
+		"cpi	r24, lo8(%[magic])	\n\t"
+		"brne	1f					\n\t"
+		"cpi	r25, hi8(%[magic])	\n\t"
+		"brne	1f					\n\t"
+		"ldi	r24, 1				\n\t"
+		"out	%[flag], r24		\n\t"
+		"1:							\n\t"
+		:: [key] "i" (BOOT_REQUEST_ADDRESS), [magic] "i" (BOOT_REQUEST_KEY), [flag] "I" (_SFR_IO_ADDR(BOOT_REQUEST_FLAG))
+	);
+}
+
+#endif
+
 #ifndef REMOVE_SPI_MULTI_SUPPORT
 
 void __jumpMain	(void) __attribute__ ((naked)) __attribute__ ((section (".init9")));
@@ -189,20 +741,118 @@ int main(void) __attribute__ ((OS_main)) __attribute__ ((section (".init9"))) __
 
 #endif
 
+#ifndef ENABLE_STREAMING_READ
 static void readDevice(uint32_t* programAddress, uint16_t msgSize, uint8_t* p);
-static void programDevice(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t msgSize, uint8_t* buffer);
+#endif
+static uint8_t programDevice(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t msgSize, uint8_t* buffer);
+#ifdef ENABLE_MULTI_PAGE_PROGRAM
+static uint8_t programBlock(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t msgSize, uint8_t* buffer);
+#else
+	#define	programBlock(programAddress, eraseAddress, msgSize, buffer)	programDevice(programAddress, eraseAddress, msgSize, buffer)
+#endif
+#ifdef ENABLE_CHIP_ERASE
+static void serviceErase(void);
+static void completeErase(void);
+static void eraseUpTo(uint32_t address);
+#else
+	#define	eraseUpTo(address)
+#endif
+#ifdef ENABLE_DOUBLE_BUFFER
+static void serviceFlash(void);
+static void completePage(void);
+#elif defined(ENABLE_CHIP_ERASE)
+	#define	serviceFlash()	serviceErase()
+	#define	completePage()	completeErase()
+#else
+	#define	serviceFlash()
+	#define	completePage()
+#endif
+#if defined(ENABLE_PAGE_COMPARE) || defined(ENABLE_VERIFY)
+static uint8_t comparePage(uint32_t address, uint16_t size, uint8_t* buffer);
+#endif
+#ifdef ENABLE_FLASH_SERVICE
+uint8_t flashServiceErase(uint32_t address) __attribute__ ((used)) __attribute__ ((externally_visible));
+void flashServiceFill(uint32_t address, uint16_t word) __attribute__ ((used)) __attribute__ ((externally_visible));
+uint8_t flashServiceWrite(uint32_t address) __attribute__ ((used)) __attribute__ ((externally_visible));
+uint8_t flashServiceProgram(uint32_t address, const uint8_t* data) __attribute__ ((used)) __attribute__ ((externally_visible));
+#endif
+#ifdef ENABLE_EEPROM
+static void programEeprom(uint32_t* programAddress, uint16_t msgSize, uint8_t* buffer);
+static void readEeprom(uint32_t* programAddress, uint16_t msgSize, uint8_t* p);
+static void serviceEeprom(void);
+static void completeEeprom(void);
+#else
+	#define	serviceEeprom()
+	#define	completeEeprom()
+#endif
+#if defined(ENABLE_FLASH_CRC) || defined(ENABLE_STAGED_UPDATE) || defined(ENABLE_IMAGE_CHECK)
+static uint16_t crcFlash(uint32_t address, uint32_t length);
+#endif
+#ifdef ENABLE_STAGED_UPDATE
+static void installStaged(void);
+#endif
+#ifdef ENABLE_IMAGE_CHECK
+static uint8_t checkImage(void);
+static void imageTouched(void);
+#ifdef ENABLE_CHIP_ERASE
+	// a trailer page the chip erase has not reached yet was not written in this upload, it is erased after the answer
+	#define	trailerStale()	( eraseAhead <= IMAGE_TRAILER )
+#else
+	#define	trailerStale()	0
+#endif
+#else
+	#define	imageTouched()
+#endif
+#ifdef ENABLE_COMPRESSED_PROGRAM
+static uint8_t programCompressed(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t outSize, uint8_t* stream, uint16_t streamSize);
+#endif
+#ifdef ENABLE_PERF_COUNTERS
+static void perfSpmBusyWait(void);
+static void perfIdleWait(void);
+#endif
 static int8_t serialAvailable(void);
+#ifdef RX_RING
+static void pollSerial(void);
+#endif
+#ifdef ENABLE_FLOW_CONTROL
+static void flowHold(void);
+static void flowRelease(void);
+#else
+	#define	flowHold()
+	#define	flowRelease()
+#endif
 static uint8_t recieveChar(void);
 static __attribute__((noinline)) void transmitChar(int8_t c);
+static void transmitFlush(void);
 static uint8_t getParameter(uint8_t cmd);
-static void recieveData(uint8_t* seqNum, uint8_t* msgBuffer);
+#ifdef ENABLE_SESSION_INFO
+static uint8_t* sessionInfo(uint8_t* p);
+#endif
+static void timerStart(void);
+static uint8_t timerTick(void);
+static void timerStop(void);
+static void recieveData(uint8_t* seqNum, uint8_t* msgBuffer, uint32_t* programAddress, uint8_t msgParseState);
+#ifdef ENABLE_BAUD_SWITCH
+static void setBaudRate(uint8_t index);
+#endif
+#ifdef ENABLE_BOOT_POLICY
+static uint16_t bootWindow(uint8_t resetSource);
+#endif
+#ifdef ENABLE_AUTOBAUD
+static uint8_t waitRxd(uint8_t level);
+static int16_t measureBaudRate(void);
+#endif
 void appStart(void);
 
+#ifndef ENABLE_STREAMING_READ
 static void readDevice(uint32_t* programAddress, uint16_t msgSize, uint8_t* p)
 {
 	uint16_t data;
 	*p++						=	STATUS_CMD_OK;
 
+	completePage();					// flash can not be read while the last page is being written
+
+	traceBegin(TRACE_READ);
 	// Read FLASH
 	do {
 #if (FLASHEND > 0x10000)
@@ -216,70 +866,910 @@ static void readDevice(uint32_t* programAddress, uint16_t msgSize, uint8_t* p)
 		msgSize	-=	2;
 	}
 	while (msgSize);
+	traceEnd(TRACE_READ);
 }
+#endif
 
-static void programDevice(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t msgSize, uint8_t* buffer)
+#if defined(ENABLE_FLASH_CRC) || defined(ENABLE_STAGED_UPDATE) || defined(ENABLE_IMAGE_CHECK)
+/*
+ * CRC-CCITT (0x8408 reflected, starting at 0xFFFF) over a flash range
+ */
+static uint16_t crcFlash(uint32_t address, uint32_t length)
 {
-	uint32_t tempAddress	=	*programAddress;
+	uint16_t crc	=	0xFFFF;
 
-	if (*eraseAddress < APP_END )
-	{
-		boot_page_erase(*eraseAddress);
-		boot_spm_busy_wait();
-		*eraseAddress += SPM_PAGESIZE;
+	while (length) {
+		crc	=	_crc_ccitt_update(crc, readFlashByte(address));
+		address++;
+		length--;
 	}
 
-	do {
-		uint16_t word = *buffer++;
-		word += (*buffer++) << 8;
-		boot_page_fill(*programAddress,	word);
-
-		*programAddress	+= 2;
-		msgSize					-= 2;
-	} while (msgSize);
-
-	boot_page_write(tempAddress);
-	boot_spm_busy_wait();
-	boot_rww_enable();				// Re-enable the RWW section
+	return crc;
 }
+#endif
 
+#if defined(ENABLE_PAGE_COMPARE) || defined(ENABLE_VERIFY)
 /*
- * wait for data on USART
+ * Check the new data against the current flash contents
  */
-static int8_t serialAvailable(void)
+static uint8_t comparePage(uint32_t address, uint16_t size, uint8_t* buffer)
 {
+	uint8_t result	=	0;
 
-	return(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE));	// wait for data
+	do {
+		uint16_t data	=	readFlashWord(address);
+		if (data != 0xFFFF) {
+			result	|=	PAGE_NOT_BLANK;
+		}
+		if ( ( (uint8_t)data != buffer[0] ) || ( (uint8_t)(data >> 8) != buffer[1] ) ) {
+			result	|=	PAGE_DIFFERS;
+		}
+		buffer	+=	2;
+		address	+=	2;
+		size		-=	2;
+	} while ( size && ( result != ( PAGE_DIFFERS | PAGE_NOT_BLANK ) ) );
 
+	return result;
 }
+#endif
 
-#define	MAX_TIME_COUNT	(F_CPU >> 1)
-
+#ifdef ENABLE_DOUBLE_BUFFER
 /*
- * recieve single byte from USART
+ * Fill the page buffer and only kick off the erase / write, the page is committed in the
+ * background by serviceFlash() while the next message is being received. The page buffer is
+ * kept during a page erase so it can be filled first. Returns the result of the previous page.
+ * A write erases its page first, the data of a page has to come in one write starting on its boundary.
  */
-static uint8_t recieveChar(void)
+static uint8_t programDevice(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t msgSize, uint8_t* buffer)
 {
+	uint8_t	status;
+	uint16_t sum					=	0;
+	uint32_t tempAddress	=	*programAddress;
 
-	while (!(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE)))
-		;
+	if ( ( msgSize == 0 ) || ( msgSize > SPM_PAGESIZE ) ) {
+		return STATUS_CMD_FAILED;		// one page buffer, larger blocks go through programBlock()
+	}
+	completeEeprom();				// no SPM while an EEPROM write is in progress
+	imageTouched();
+	completePage();
+	status			=	pageStatus;
+	pageStatus	=	STATUS_CMD_OK;
+
+#ifdef ENABLE_CHIP_ERASE
+	eraseUpTo(tempAddress);
+#endif
+
+	// the page being written is always erased first, unless the chip erase left it clean and nothing went to it since
+	*eraseAddress	=	tempAddress & ~((uint32_t)SPM_PAGESIZE - 1);
+#ifdef ENABLE_CHIP_ERASE
+	if (*eraseAddress >= eraseClean) {
+		eraseClean		=	*eraseAddress + SPM_PAGESIZE;
+		*eraseAddress	=	APP_END;
+	}
+#endif
+
+#ifdef ENABLE_PAGE_COMPARE
+	uint8_t compare	=	comparePage(tempAddress, msgSize, buffer);
+	if (!(compare & PAGE_DIFFERS)) {
+		skippedPages++;
+		perfCount(PERF_PAGES_SKIPPED);
+		*programAddress	+=	msgSize;
+		if (*eraseAddress < APP_END) {
+			*eraseAddress	+=	SPM_PAGESIZE;
+		}
+		return status;
+	}
+#else
+	uint8_t compare	=	PAGE_NOT_BLANK;
+#endif
+
+	pagePending	=	tempAddress;
+	pageSize		=	msgSize;
+
+	traceBegin(TRACE_FILL);
+	do {
+		uint16_t word = *buffer++;
+		word += (*buffer++) << 8;
+		boot_page_fill(*programAddress,	word);
+		sum	+= word;
+
+		*programAddress	+= 2;
+		msgSize					-= 2;
+	} while (msgSize);
+	traceEnd(TRACE_FILL);
+
+	pageSum	=	sum;
+
+	if (tempAddress >= NRWW_START) {
+		flowHold();
+	}
+	pageState	=	PAGE_ERASING;
+	if (*eraseAddress < APP_END )
+	{
+		if (compare & PAGE_NOT_BLANK) {
+			if (*eraseAddress >= NRWW_START) {
+				tempAddress	=	NRWW_START;		// erasing the NRWW section stalls as well
+			}
+			traceBegin(TRACE_ERASE);
+			boot_page_erase(*eraseAddress);
+			perfCount(PERF_PAGES_ERASED);
+		}
+		*eraseAddress += SPM_PAGESIZE;
+	}
+	serviceFlash();					// nothing to erase, start the write straight away
+
+	// the CPU is halted while the NRWW section is busy and nothing could be received, so finish it now
+	if (tempAddress >= NRWW_START) {
+		completePage();
+		flowRelease();
+	}
+
+	return status;
+}
+
+/*
+ * Start the page write once the erase has finished, called while waiting for serial data
+ */
+static void serviceFlash(void)
+{
+	if ( ( pageState == PAGE_ERASING ) && ( !boot_spm_busy() ) ) {
+		traceEnd(TRACE_ERASE);
+		traceBegin(TRACE_WRITE);
+		boot_page_write(pagePending);
+		pageState	=	PAGE_WRITING;
+		perfCount(PERF_PAGES_WRITTEN);
+	}
+#ifdef ENABLE_CHIP_ERASE
+	else if (pageState != PAGE_ERASING) {
+		serviceErase();					// the page buffer is empty once a write has started
+	}
+#endif
+}
+
+/*
+ * Wait for the page left in the SPM unit, then check it landed in flash
+ */
+static void completePage(void)
+{
+	if (pageState != PAGE_IDLE) {
+		uint16_t sum		=	0;
+		uint16_t size		=	pageSize;
+		uint32_t address	=	pagePending;
+
+		spmBusyWait();
+		serviceFlash();
+		spmBusyWait();
+		boot_rww_enable();				// Re-enable the RWW section
+		pageState	=	PAGE_IDLE;
+		traceEnd(TRACE_WRITE);
+
+		do {
+			sum			+=	readFlashWord(address);
+			address	+=	2;
+			size		-=	2;
+		} while (size);
+
+		if (sum != pageSum) {
+			pageStatus	=	STATUS_CMD_FAILED;
+		}
+	}
+#ifdef ENABLE_CHIP_ERASE
+	else {
+		completeErase();
+	}
+#endif
+}
+
+#else
+
+/*
+ * Erase and write one page, the data of a page has to come in one write starting on its boundary
+ */
+static uint8_t programDevice(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t msgSize, uint8_t* buffer)
+{
+	uint32_t tempAddress	=	*programAddress;
+#ifdef ENABLE_VERIFY
+	uint16_t verifySize		=	msgSize;
+	uint8_t* verifyData		=	buffer;
+#endif
+
+	if ( ( msgSize == 0 ) || ( msgSize > SPM_PAGESIZE ) ) {
+		return STATUS_CMD_FAILED;		// one page buffer, larger blocks go through programBlock()
+	}
+	completeEeprom();				// no SPM while an EEPROM write is in progress
+	imageTouched();
+#ifdef ENABLE_CHIP_ERASE
+	eraseUpTo(tempAddress);
+#endif
+
+	// the page being written is always erased first, unless the chip erase left it clean and nothing went to it since
+	*eraseAddress	=	tempAddress & ~((uint32_t)SPM_PAGESIZE - 1);
+#ifdef ENABLE_CHIP_ERASE
+	if (*eraseAddress >= eraseClean) {
+		eraseClean		=	*eraseAddress + SPM_PAGESIZE;
+		*eraseAddress	=	APP_END;
+	}
+#endif
+
+#ifdef ENABLE_PAGE_COMPARE
+	uint8_t compare	=	comparePage(tempAddress, msgSize, buffer);
+	if (!(compare & PAGE_DIFFERS)) {
+		skippedPages++;
+		perfCount(PERF_PAGES_SKIPPED);
+		*programAddress	+=	msgSize;
+		if (*eraseAddress < APP_END) {
+			*eraseAddress	+=	SPM_PAGESIZE;
+		}
+		return STATUS_CMD_OK;
+	}
+#else
+	uint8_t compare	=	PAGE_NOT_BLANK;
+#endif
+
+	if (tempAddress >= NRWW_START) {
+		flowHold();						// the erase and the write halt the CPU
+	}
+	if (*eraseAddress < APP_END )
+	{
+		if (compare & PAGE_NOT_BLANK) {
+			traceBegin(TRACE_ERASE);
+			boot_page_erase(*eraseAddress);
+			perfCount(PERF_PAGES_ERASED);
+			spmBusyWait();
+			traceEnd(TRACE_ERASE);
+		}
+		*eraseAddress += SPM_PAGESIZE;
+	}
+
+#ifdef ENABLE_STREAMING_PROGRAM
+	// recieveData() already filled the page buffer
+	*programAddress	+= msgSize;
+#else
+	traceBegin(TRACE_FILL);
+	do {
+		uint16_t word = *buffer++;
+		word += (*buffer++) << 8;
+		boot_page_fill(*programAddress,	word);
+
+		*programAddress	+= 2;
+		msgSize					-= 2;
+	} while (msgSize);
+	traceEnd(TRACE_FILL);
+#endif
+
+	traceBegin(TRACE_WRITE);
+	boot_page_write(tempAddress);
+	perfCount(PERF_PAGES_WRITTEN);
+	spmBusyWait();
+	boot_rww_enable();				// Re-enable the RWW section
+	traceEnd(TRACE_WRITE);
+	flowRelease();
+
+#ifdef ENABLE_VERIFY
+	if (comparePage(tempAddress, verifySize, verifyData) & PAGE_DIFFERS) {
+		return STATUS_CMD_FAILED;
+	}
+#endif
+
+	return STATUS_CMD_OK;
+}
+
+#endif
+
+#ifdef ENABLE_MULTI_PAGE_PROGRAM
+/*
+ * Program a block of several pages starting on a page boundary, programDevice() erases and
+ * writes one page at a time
+ */
+static uint8_t programBlock(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t msgSize, uint8_t* buffer)
+{
+	uint8_t	status	=	STATUS_CMD_OK;
+
+	if ( ( msgSize > PROGRAM_BLOCK_SIZE ) || ( (uint16_t)*programAddress & ( SPM_PAGESIZE - 1 ) ) ) {
+		return STATUS_CMD_FAILED;
+	}
+	while (msgSize) {
+		uint16_t	size	=	SPM_PAGESIZE - ( (uint16_t)*programAddress & ( SPM_PAGESIZE - 1 ) );
+		if (size > msgSize) {
+			size	=	msgSize;
+		}
+		status	|=	programDevice(programAddress, eraseAddress, size, buffer);
+		buffer	+=	size;
+		msgSize	-=	size;
+	}
+
+	return status;
+}
+#endif
+
+#ifdef ENABLE_CHIP_ERASE
+/*
+ * Erase the next page of a chip erase while waiting for serial data. The NRWW pages would
+ * stall the CPU and are left for eraseUpTo().
+ */
+static void serviceErase(void)
+{
+	if ( ( eraseAhead < APP_END ) && ( eraseAhead < NRWW_START ) && ( !boot_spm_busy() ) ) {
+#ifdef ENABLE_EEPROM
+		if ( ( eepromHead != eepromTail ) || ( EECR & ( 1 << EEWE ) ) ) {
+			return;
+		}
+#endif
+		boot_page_erase(eraseAhead);
+		perfCount(PERF_PAGES_ERASED);
+		eraseAhead	+=	SPM_PAGESIZE;
+	}
+}
+
+/*
+ * Wait for the page being erased and make the RWW section readable again
+ */
+static void completeErase(void)
+{
+	spmBusyWait();
+	boot_rww_enable();
+}
+
+/*
+ * Erase the pages the background erase has not reached yet, up to the one holding address
+ */
+static void eraseUpTo(uint32_t address)
+{
+	spmBusyWait();
+	while ( ( eraseAhead <= address ) && ( eraseAhead < APP_END ) ) {
+		if (eraseAhead >= NRWW_START) {
+			flowHold();
+		}
+		traceBegin(TRACE_ERASE);
+		boot_page_erase(eraseAhead);
+		perfCount(PERF_PAGES_ERASED);
+		spmBusyWait();
+		traceEnd(TRACE_ERASE);
+		eraseAhead	+=	SPM_PAGESIZE;
+	}
+	boot_rww_enable();
+	flowRelease();
+}
+#endif
+
+#ifdef ENABLE_STAGED_UPDATE
+/*
+ * Copy a staged image with a sound header over the application page by page. A reset during
+ * the copy starts it again, the staged image is left as it is until the header is erased.
+ */
+static void installStaged(void)
+{
+	uint32_t	length	=	readFlashWord(STAGE_HEADER + 4) | ( (uint32_t)readFlashWord(STAGE_HEADER + 6) << 16 );
+	uint32_t	address;
+	uint16_t	offset;
+
+	if ( ( readFlashWord(STAGE_HEADER) != STAGE_MAGIC ) || ( length == 0 ) || ( length > STAGE_SIZE ) ) {
+		return;
+	}
+	if (crcFlash(STAGE_START, length) != readFlashWord(STAGE_HEADER + 8)) {
+		return;							// not completely staged, keep the application
+	}
+
+	imageTouched();
+	flowHold();							// the copy does not poll the USART
+	for (address = 0; address < length; address += SPM_PAGESIZE) {
+		boot_page_erase(address);
+		boot_spm_busy_wait();
+		boot_rww_enable();				// the staged page is read from the RWW section
+		for (offset = 0; offset < SPM_PAGESIZE; offset += 2) {
+			boot_page_fill(address + offset, readFlashWord(STAGE_START + address + offset));
+		}
+		boot_page_write(address);
+		boot_spm_busy_wait();
+		boot_rww_enable();
+	}
+
+	boot_page_erase(STAGE_HEADER);
+	boot_spm_busy_wait();
+	boot_rww_enable();
+	flowRelease();
+}
+#endif
+
+#ifdef ENABLE_IMAGE_CHECK
+/*
+ * Check the application against its trailer, STATUS_CMD_OK when it may be started. Only the
+ * first check after flash has been written runs the CRC.
+ */
+static uint8_t checkImage(void)
+{
+	uint32_t	length	=	readFlashWord(IMAGE_TRAILER + 2) | ( (uint32_t)readFlashWord(IMAGE_TRAILER + 4) << 16 );
+
+	if ( ( readFlashWord(IMAGE_TRAILER) != IMAGE_MAGIC ) || ( length > IMAGE_TRAILER ) ) {
+		return STATUS_CMD_FAILED;
+	}
+	EEAR	=	IMAGE_CHECK_EEPROM;
+	EECR	|=	( 1 << EERE );
+	if (EEDR == IMAGE_VERIFIED) {
+		return STATUS_CMD_OK;
+	}
+	if (crcFlash(0, length) != readFlashWord(IMAGE_TRAILER + 6)) {
+		return STATUS_CMD_FAILED;
+	}
+	EEDR	=	IMAGE_VERIFIED;
+	EECR	|=	( 1 << EEMWE );
+	EECR	|=	( 1 << EEWE );
+	while ( EECR & ( 1 << EEWE ) );		// no SPM until the EEPROM write is done
+	return STATUS_CMD_OK;
+}
+
+/*
+ * Drop the cached check before flash is written, called with no EEPROM write queued. Waits
+ * for its own write so the SPM that follows can start.
+ */
+static void imageTouched(void)
+{
+	while ( EECR & ( 1 << EEWE ) );
+	EEAR	=	IMAGE_CHECK_EEPROM;
+	EECR	|=	( 1 << EERE );
+	if (EEDR != 0xFF) {
+		EEDR	=	0xFF;
+		EECR	|=	( 1 << EEMWE );
+		EECR	|=	( 1 << EEWE );
+		while ( EECR & ( 1 << EEWE ) );
+	}
+}
+#endif
+
+#ifdef ENABLE_FLASH_SERVICE
+/*
+ * Jump table the application calls to write its own flash, FLASH_SERVICE_ADDRESS in the
+ * Makefile places it in the last 8 bytes of flash. See flashService.h for the calls.
+ */
+void __flashService (void) __attribute__ ((naked)) __attribute__ ((used)) __attribute__ ((section (".flashservice")));
+
+void __flashService(void)
+{
+	asm volatile (
+		"rjmp	flashServiceErase	\n\t"
+		"rjmp	flashServiceFill	\n\t"
+		"rjmp	flashServiceWrite	\n\t"
+		"rjmp	flashServiceProgram	\n\t"
+	);
+}
+
+/*
+ * The services run with the interrupts off, the application vectors are not readable while
+ * SPM is busy on the RWW section. They only use the stack, the bootloader variables share
+ * their RAM with the application.
+ */
+uint8_t flashServiceErase(uint32_t address)
+{
+	uint8_t	sreg	=	SREG;
+
+	if (address >= APP_END) {
+		return STATUS_CMD_FAILED;
+	}
+	__asm__ __volatile__ ("cli");
+	imageTouched();
+	while ( EECR & ( 1 << EEWE ) );		// no SPM while an EEPROM write is in progress
+	boot_page_erase(address);
+	boot_spm_busy_wait();
+	boot_rww_enable();
+	SREG	=	sreg;
+	return STATUS_CMD_OK;
+}
+
+/*
+ * Fill one word of the page buffer, call it after flashServiceErase(), re-enabling the RWW
+ * section clears the page buffer
+ */
+void flashServiceFill(uint32_t address, uint16_t word)
+{
+	uint8_t	sreg	=	SREG;
+
+	__asm__ __volatile__ ("cli");
+	boot_page_fill(address, word);
+	SREG	=	sreg;
+}
+
+uint8_t flashServiceWrite(uint32_t address)
+{
+	uint8_t	sreg	=	SREG;
+
+	if (address >= APP_END) {
+		return STATUS_CMD_FAILED;
+	}
+	__asm__ __volatile__ ("cli");
+	imageTouched();
+	while ( EECR & ( 1 << EEWE ) );
+	boot_page_write(address);
+	boot_spm_busy_wait();
+	boot_rww_enable();
+	SREG	=	sreg;
+	return STATUS_CMD_OK;
+}
+
+/*
+ * Erase, fill and write the page at address with SPM_PAGESIZE bytes from data
+ */
+uint8_t flashServiceProgram(uint32_t address, const uint8_t* data)
+{
+	uint16_t offset;
+
+	address	&=	~((uint32_t)SPM_PAGESIZE - 1);
+	if (flashServiceErase(address) != STATUS_CMD_OK) {
+		return STATUS_CMD_FAILED;
+	}
+	for (offset = 0; offset < SPM_PAGESIZE; offset += 2) {
+		flashServiceFill(address + offset, data[offset] | ( data[offset + 1] << 8 ));
+	}
+	return flashServiceWrite(address);
+}
+#endif
+
+#ifdef ENABLE_EEPROM
+/*
+ * Queue the bytes for serviceEeprom(), which starts one write at a time while the next message
+ * is being received. The address follows the flash convention of two steps per byte.
+ */
+static void programEeprom(uint32_t* programAddress, uint16_t msgSize, uint8_t* buffer)
+{
+	uint16_t eeAddress	=	*programAddress >> 1;
+
+	completePage();					// no EEPROM write while SPM is in progress
+
+	// the queue only holds a contiguous run
+	if ( eeAddress != ( eepromAddress + (uint8_t)( eepromHead - eepromTail ) ) ) {
+		completeEeprom();
+		eepromAddress	=	eeAddress;
+	}
+
+	while (msgSize) {
+		while ( (uint8_t)( eepromHead + 1 ) == eepromTail ) {
+			serviceEeprom();			// queue full
+		}
+		eepromQueue[eepromHead++]	=	*buffer++;
+		*programAddress	+=	2;
+		msgSize--;
+	}
+	serviceEeprom();
+}
+
+/*
+ * Start the next queued EEPROM write once the last one has finished, bytes already
+ * holding the value are skipped
+ */
+static void serviceEeprom(void)
+{
+	if ( ( eepromHead != eepromTail ) && ( !( EECR & ( 1 << EEWE ) ) ) ) {
+		uint8_t data	=	eepromQueue[eepromTail++];
+		EEAR	=	eepromAddress++;
+		EECR	|=	( 1 << EERE );
+		if (EEDR != data) {
+			EEDR	=	data;
+			EECR	|=	( 1 << EEMWE );
+			EECR	|=	( 1 << EEWE );
+		}
+	}
+}
+
+/*
+ * Write out the whole queue and wait for the last byte
+ */
+static void completeEeprom(void)
+{
+	while (eepromHead != eepromTail) {
+		serviceEeprom();
+#ifdef RX_RING
+		pollSerial();
+#endif
+	}
+	while (EECR & ( 1 << EEWE )) {
+#ifdef RX_RING
+		pollSerial();
+#endif
+	}
+}
+
+static void readEeprom(uint32_t* programAddress, uint16_t msgSize, uint8_t* p)
+{
+	uint16_t eeAddress	=	*programAddress >> 1;
+
+	completeEeprom();
+	*p++	=	STATUS_CMD_OK;
+
+	while (msgSize) {
+		EEAR	=	eeAddress++;
+		EECR	|=	( 1 << EERE );
+		*p++	=	EEDR;
+		*programAddress	+=	2;
+		msgSize--;
+	}
+	*p	=	STATUS_CMD_OK;
+}
+#endif
+
+#ifdef ENABLE_COMPRESSED_PROGRAM
+/*
+ * Inflate an LZ stream into pages and program them through programDevice(), the output has to
+ * start on a page boundary. A token below 0x80 is followed by token + 1 literal bytes, otherwise
+ * (token & 0x7F) + 3 bytes are copied from a distance given by the next two bytes, MSB first.
+ * The copy comes from the page being inflated or from the flash already programmed.
+ */
+static uint8_t programCompressed(uint32_t* programAddress, uint32_t* eraseAddress, uint16_t outSize, uint8_t* stream, uint16_t streamSize)
+{
+	uint8_t		page[SPM_PAGESIZE];
+	uint8_t		*end		=	stream + streamSize;
+	uint8_t		status	=	STATUS_CMD_OK;
+	uint16_t	fill		=	0;
+
+	if ( ( outSize & 1 ) || ( (uint16_t)*programAddress & ( SPM_PAGESIZE - 1 ) ) ) {
+		return STATUS_CMD_FAILED;
+	}
+
+	// walk the tokens first, a stream running past its end or not adding up to outSize programs nothing
+	uint8_t		*p			=	stream;
+	uint32_t	total		=	0;
+	while (p < end) {
+		uint8_t	token	=	*p++;
+		if (token & 0x80) {
+			if ( ( ( end - p ) < 2 ) || ( ( p[0] | p[1] ) == 0 ) ) {
+				return STATUS_CMD_FAILED;
+			}
+			total	+=	(token & 0x7F) + 3;
+			p			+=	2;
+		}
+		else {
+			if ( ( end - p ) <= token ) {
+				return STATUS_CMD_FAILED;
+			}
+			total	+=	token + 1;
+			p			+=	token + 1;
+		}
+	}
+	if (total != outSize) {
+		return STATUS_CMD_FAILED;
+	}
+
+	while ( outSize && ( stream < end ) ) {
+		uint8_t		token			=	*stream++;
+		uint8_t		count			=	token + 1;
+		uint16_t	distance	=	0;
+
+		if (token & 0x80) {
+			count			=	(token & 0x7F) + 3;
+			distance	=	(stream[0] << 8) | stream[1];
+			stream		+=	2;
+		}
+
+		while ( count-- && outSize ) {
+			uint8_t c;
+			if (distance == 0) {
+				c	=	*stream++;
+			}
+			else if (distance <= fill) {
+				c	=	page[fill - distance];
+			}
+			else {
+				completePage();
+				c	=	readFlashByte(*programAddress - (distance - fill));
+			}
+			page[fill++]	=	c;
+			outSize--;
+
+			if ( ( fill == SPM_PAGESIZE ) || ( outSize == 0 ) ) {
+				status	|=	programDevice(programAddress, eraseAddress, fill, page);
+				fill		=	0;
+			}
+		}
+	}
+
+	if ( outSize || ( stream != end ) ) {
+		status	=	STATUS_CMD_FAILED;
+	}
+
+	return status;
+}
+#endif
+
+/*
+ * wait for data on USART
+ */
+static int8_t serialAvailable(void)
+{
+
+#ifdef RX_RING
+	pollSerial();
+	return(rxHead != rxTail);
+#else
+	return(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE));	// wait for data
+#endif
+
+}
+
+#ifdef RX_RING
+/*
+ * Move a received byte into the ring, a byte that does not fit is dropped and the
+ * frame fails its checksum
+ */
+static void pollSerial(void)
+{
+	if (UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE)) {
+		uint8_t		c			=	UART_DATA_REG;
+		uint16_t	next	=	( rxHead + 1 ) & ( RX_RING_SIZE - 1 );
+		if (next != rxTail) {
+			rxRing[rxHead]	=	c;
+			rxHead					=	next;
+		}
+#ifdef ENABLE_FLOW_CONTROL
+		if ( ( ( rxHead - rxTail ) & ( RX_RING_SIZE - 1 ) ) >= ( RX_RING_SIZE - RX_RING_HEADROOM ) ) {
+			FLOW_RTS_PORT	|=	( 1 << FLOW_RTS_BIT );		// stop the host
+		}
+#endif
+	}
+}
+#endif
+
+#ifdef ENABLE_FLOW_CONTROL
+/*
+ * Stop the host before an SPM on the NRWW section, nothing is received while the CPU is halted.
+ * The bytes already on their way are taken into the ring first.
+ */
+static void flowHold(void)
+{
+	FLOW_RTS_PORT	|=	( 1 << FLOW_RTS_BIT );		// the pull-up while RTS is still an input
+	for (uint16_t loops = 0; loops < FLOW_HOLD_LOOPS; loops++) {
+		pollSerial();
+	}
+}
+
+/*
+ * Let the host go on once the ring has room again
+ */
+static void flowRelease(void)
+{
+	if ( ( ( rxHead - rxTail ) & ( RX_RING_SIZE - 1 ) ) < ( RX_RING_SIZE - 2 * RX_RING_HEADROOM ) ) {
+		FLOW_RTS_PORT	&=	~( 1 << FLOW_RTS_BIT );
+	}
+}
+#endif
+
+#ifdef ENABLE_PERF_COUNTERS
+/*
+ * spmBusyWait() with the time it stalls added to PERF_SPM_WAIT
+ */
+static void perfSpmBusyWait(void)
+{
+	uint16_t	start	=	TCNT1;
+
+	spmBusyPoll();
+	perfCounters[PERF_SPM_WAIT]	+=	(uint16_t)( TCNT1 - start );
+}
+
+/*
+ * Wait for the first byte of a message, the time is added up while waiting as timer 1
+ * wraps after 65536 ticks
+ */
+static void perfIdleWait(void)
+{
+	uint16_t	last	=	TCNT1;
+
+	while (!serialAvailable()) {
+		uint16_t	now	=	TCNT1;
+		perfCounters[PERF_RX_IDLE]	+=	(uint16_t)( now - last );
+		last	=	now;
+		serviceFlash();
+		serviceEeprom();
+	}
+	perfCounters[PERF_RX_IDLE]	+=	(uint16_t)( TCNT1 - last );
+}
+#endif
+
+#define	MAX_TIME_COUNT	(F_CPU >> 1)
+
+/*
+ * recieve single byte from USART
+ */
+static uint8_t recieveChar(void)
+{
+
+#ifdef RX_RING
+	uint8_t c;
+
+	while (rxHead == rxTail) {
+		pollSerial();
+		serviceFlash();
+		serviceEeprom();
+	}
+	c				=	rxRing[rxTail];
+	rxTail	=	( rxTail + 1 ) & ( RX_RING_SIZE - 1 );
+	flowRelease();
+
+	return c;
+#else
+	while (!(UART_STATUS_REG & (1 << UART_RECEIVE_COMPLETE))) {
+		serviceFlash();
+		serviceEeprom();
+	}
+
+	return UART_DATA_REG;
+#endif
+
+}
+
+/*
+ * transmit single byte to USART, the byte is loaded as soon as the data register is empty
+ * so it goes out straight after the one still in the shift register
+ */
+static __attribute__((noinline)) void transmitChar(int8_t c)
+{
+
+	while (!(UART_STATUS_REG & (1 << UART_DATA_EMPTY))) {
+#ifdef RX_RING
+		pollSerial();
+#endif
+	}
+#ifdef ENABLE_FLOW_CONTROL
+	while (FLOW_CTS_PIN & ( 1 << FLOW_CTS_BIT )) {
+		pollSerial();				// the host can not take more
+	}
+#endif
+
+	UART_DATA_REG	=	c;
+
+	UART_STATUS_REG |= (1 << UART_TRANSMIT_COMPLETE);	// only set again once the shift register is empty
+
+}
+
+/*
+ * wait until the last byte has been shifted out, before the USART is changed
+ */
+static void transmitFlush(void)
+{
+
+	while (!(UART_STATUS_REG & (1 << UART_TRANSMIT_COMPLETE))) {
+#ifdef RX_RING
+		pollSerial();
+#endif
+	}
+
+}
+
+/*
+ * ms timer used for the boot window and other timeouts
+ */
+static void timerStart(void)
+{
+
+	TCNT0		=	0;
+	OCR0A		=	BOOT_TIMER_TOP;
+	TCCR0A	=	( 1 << WGM01 );				// CTC
+	TIFR0		=	( 1 << OCF0A );
+	TCCR0B	=	BOOT_TIMER_PRESCALER;
+
+}
+
+/*
+ * 1 once per ms
+ */
+static uint8_t timerTick(void)
+{
 
-	return UART_DATA_REG;
+	if (TIFR0 & ( 1 << OCF0A )) {
+		TIFR0	=	( 1 << OCF0A );
+		return 1;
+	}
+	return 0;
 
 }
 
 /*
- * transmit single byte to USART, wait until transmission is completed
+ * put timer 0 back into its reset state for the application
  */
-static __attribute__((noinline)) void transmitChar(int8_t c)
+static void timerStop(void)
 {
 
-	UART_DATA_REG	=	c;
-
-	while (!(UART_STATUS_REG & (1 << UART_TRANSMIT_COMPLETE)))
-		;
-
-	UART_STATUS_REG |= (1 << UART_TRANSMIT_COMPLETE);
+	TCCR0B	=	0;
+	TCCR0A	=	0;
+	OCR0A		=	0;
+	TCNT0		=	0;
+	TIFR0		=	( 1 << OCF0A );
 
 }
 
@@ -303,6 +1793,33 @@ static uint8_t getParameter(uint8_t cmd)
 		else if(cmd == PARAM_SW_MINOR) {
         value	= CONFIG_PARAM_SW_MINOR;
     }
+#ifdef ENABLE_BAUD_SWITCH
+		else if(cmd == PARAM_BAUD_RATE) {
+        value	= BAUD_RATES_SUPPORTED;
+    }
+#endif
+#ifdef ENABLE_WINDOWED_PROGRAM
+		else if(cmd == PARAM_WINDOW_SIZE) {
+        value	= windowSize;
+    }
+#endif
+#ifdef ENABLE_PERF_COUNTERS
+		else if( ( cmd >= PARAM_PERF_COUNTERS ) && ( cmd < PARAM_PERF_COUNTERS + 4 * PERF_COUNTERS ) ) {
+        uint8_t index	= cmd - PARAM_PERF_COUNTERS;
+        if (!( index & 3 )) {
+            perfLatch	= perfCounters[index >> 2];
+        }
+        value	= ((uint8_t*)&perfLatch)[index & 3];
+    }
+#endif
+#ifdef ENABLE_PAGE_COMPARE
+		else if(cmd == PARAM_SKIPPED_PAGES_LOW) {
+        value	= (uint8_t)skippedPages;
+    }
+		else if(cmd == PARAM_SKIPPED_PAGES_HIGH) {
+        value	= (uint8_t)(skippedPages >> 8);
+    }
+#endif
 		else {
         value	= 0;
 		}
@@ -310,23 +1827,155 @@ static uint8_t getParameter(uint8_t cmd)
 	return value;
 }
 
-static void recieveData(uint8_t* seqNum, uint8_t* buffer)
+#ifdef ENABLE_SESSION_INFO
+/*
+ * Everything a host asks for before programming, returns the end of the answer
+ */
+static uint8_t* sessionInfo(uint8_t* p)
+{
+	uint16_t caps		=	0;
+	uint16_t caps2	=	0;
+
+#ifdef ENABLE_DOUBLE_BUFFER
+	caps	|=	CAP_DOUBLE_BUFFER;
+#endif
+#ifdef ENABLE_PAGE_COMPARE
+	caps	|=	CAP_PAGE_COMPARE;
+#endif
+#ifdef ENABLE_STREAMING_PROGRAM
+	caps	|=	CAP_STREAMING_PROGRAM;
+#endif
+#ifdef ENABLE_STREAMING_READ
+	caps	|=	CAP_STREAMING_READ;
+#endif
+#ifdef ENABLE_BAUD_SWITCH
+	caps	|=	CAP_BAUD_SWITCH;
+#endif
+#ifdef ENABLE_AUTOBAUD
+	caps	|=	CAP_AUTOBAUD;
+#endif
+#ifdef ENABLE_FLASH_CRC
+	caps	|=	CAP_FLASH_CRC;
+#endif
+#ifdef ENABLE_COMPRESSED_PROGRAM
+	caps	|=	CAP_COMPRESSED_PROGRAM;
+#endif
+#ifdef ENABLE_EEPROM
+	caps	|=	CAP_EEPROM;
+#endif
+#ifdef ENABLE_CHECKSUM_NACK
+	caps	|=	CAP_CHECKSUM_NACK;
+#endif
+#ifdef ENABLE_WINDOWED_PROGRAM
+	caps	|=	CAP_WINDOWED_PROGRAM;
+#endif
+#ifdef ENABLE_VERIFY
+	caps	|=	CAP_VERIFY;
+#endif
+#ifdef ENABLE_CHIP_ERASE
+	caps	|=	CAP_CHIP_ERASE;
+#endif
+#ifdef ENABLE_BOOT_REQUEST
+	caps	|=	CAP_BOOT_REQUEST;
+#endif
+#ifdef ENABLE_FLASH_SERVICE
+	caps	|=	CAP_FLASH_SERVICE;
+#endif
+#ifdef ENABLE_PERF_COUNTERS
+	caps	|=	CAP_PERF_COUNTERS;
+#endif
+#ifdef ENABLE_BOOT_POLICY
+	caps2	|=	CAP2_BOOT_POLICY;
+#endif
+#ifdef ENABLE_TRACE_PINS
+	caps2	|=	CAP2_TRACE_PINS;
+#endif
+#ifdef ENABLE_RS485
+	caps2	|=	CAP2_RS485;
+#endif
+#ifdef ENABLE_STAGED_UPDATE
+	caps2	|=	CAP2_STAGED_UPDATE;
+#endif
+#ifdef ENABLE_IMAGE_CHECK
+	caps2	|=	CAP2_IMAGE_CHECK;
+#endif
+#ifdef ENABLE_FLOW_CONTROL
+	caps2	|=	CAP2_FLOW_CONTROL;
+#endif
+#ifdef ENABLE_MULTI_PAGE_PROGRAM
+	caps2	|=	CAP2_MULTI_PAGE_PROGRAM;
+#endif
+
+	completePage();					// the fuses can not be read while a page is being written
+
+	*p++	=	STATUS_CMD_OK;
+	*p++	=	(SIGNATURE_BYTES >> 16) & 0x000000FF;
+	*p++	=	(SIGNATURE_BYTES >> 8) & 0x000000FF;
+	*p++	=	SIGNATURE_BYTES & 0x000000FF;
+	*p++	=	boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
+	*p++	=	boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
+	*p++	=	boot_lock_fuse_bits_get(GET_EXTENDED_FUSE_BITS);
+	*p++	=	boot_lock_fuse_bits_get(GET_LOCK_BITS);
+	*p++	=	(uint8_t)(SPM_PAGESIZE >> 8);
+	*p++	=	(uint8_t)SPM_PAGESIZE;
+	*p++	=	(uint8_t)((uint32_t)APP_END >> 24);
+	*p++	=	(uint8_t)((uint32_t)APP_END >> 16);
+	*p++	=	(uint8_t)(APP_END >> 8);
+	*p++	=	(uint8_t)APP_END;
+	*p++	=	CONFIG_PARAM_HW_VER;
+	*p++	=	CONFIG_PARAM_SW_MAJOR;
+	*p++	=	CONFIG_PARAM_SW_MINOR;
+	*p++	=	CONFIG_PARAM_BUILD_NUMBER_HIGH;
+	*p++	=	CONFIG_PARAM_BUILD_NUMBER_LOW;
+	*p++	=	(uint8_t)(caps >> 8);
+	*p++	=	(uint8_t)caps;
+	*p++	=	(uint8_t)(MSG_BUFFER_SIZE >> 8);
+	*p++	=	(uint8_t)MSG_BUFFER_SIZE;
+	*p++	=	(uint8_t)(PROGRAM_BLOCK_SIZE >> 8);
+	*p++	=	(uint8_t)PROGRAM_BLOCK_SIZE;
+	*p++	=	(uint8_t)((uint32_t)NRWW_START >> 24);
+	*p++	=	(uint8_t)((uint32_t)NRWW_START >> 16);
+	*p++	=	(uint8_t)(NRWW_START >> 8);
+	*p++	=	(uint8_t)NRWW_START;
+	*p++	=	(uint8_t)(caps2 >> 8);
+	*p++	=	(uint8_t)caps2;
+
+	return p;
+}
+#endif
+
+/*
+ * msgParseState is normally ST_START, ST_AFTER_START when MESSAGE_START has already been read
+ */
+static void recieveData(uint8_t* seqNum, uint8_t* buffer, uint32_t* programAddress, uint8_t msgParseState)
 {
-    uint8_t	checksum		  = 0;
+    uint8_t	checksum		  = MESSAGE_START ^ 0;
     uint16_t i				  = 0;
     uint16_t length			  = 0;
 
-	uint8_t	msgParseState;
-	msgParseState	=	ST_START;
+	traceBegin(TRACE_RECEIVE);
+#ifdef ENABLE_PERF_COUNTERS
+	if (msgParseState == ST_START) {
+		perfIdleWait();
+	}
+#endif
+
 	do {
 		uint8_t c	=	recieveChar();
         switch (msgParseState) {
             case ST_START:
                 if ( c == MESSAGE_START ) {
-                    msgParseState   = ST_GET_SEQ_NUM;
+                    msgParseState   = ST_AFTER_START;
                     checksum        = MESSAGE_START ^ 0;
                 }
                 break;
+#ifdef ENABLE_RS485
+            case ST_GET_NODE:
+                frameNode       = c;
+                msgParseState   = ST_GET_SEQ_NUM;
+                checksum        ^= c;
+                break;
+#endif
             case ST_GET_SEQ_NUM:
                 *seqNum         = c;
                 msgParseState   = ST_MSG_SIZE_1;
@@ -343,6 +1992,10 @@ static void recieveData(uint8_t* seqNum, uint8_t* buffer)
                 length       |= c;
                 msgParseState   = ST_GET_TOKEN;
                 checksum        ^= c;
+                if ( ( length == 0 ) || ( ( length > MSG_LENGTH_MAX ) && !frameForeign() ) ) {
+                    perfCount(PERF_CHECKSUM_ERRORS);
+                    msgParseState   = ST_START;     // a damaged length would run past msgBuffer
+                }
                 break;
 
             case ST_GET_TOKEN:
@@ -357,7 +2010,29 @@ static void recieveData(uint8_t* seqNum, uint8_t* buffer)
                 break;
 
             case ST_GET_DATA:
-                buffer[i++]      = c;
+#ifdef ENABLE_STREAMING_PROGRAM
+                // page data goes straight into the page buffer, the page is only written once the checksum matched
+                if ( ( i >= 10 ) && ( buffer[0] == CMD_PROGRAM_FLASH_ISP ) ) {
+                    if ( i == 10 ) {
+                        imageTouched();     // the check byte is cleared before the fill, an EEPROM write drops the page buffer
+                    }
+                    if ( i & 1 ) {
+                        boot_page_fill(*programAddress + i - 11, buffer[10] | (c << 8));
+                    }
+                    else {
+                        buffer[10]  = c;
+                    }
+                }
+                else if ( i < MSG_BUFFER_SIZE ) {
+                    buffer[i]   = c;
+                }
+                i++;
+#else
+                if ( ( i < MSG_BUFFER_SIZE ) && !frameForeign() ) {
+                    buffer[i]   = c;
+                }
+                i++;
+#endif
                 checksum            ^= c;
                 if (i == length ) {
                     msgParseState   = ST_GET_CHECK;
@@ -365,17 +2040,157 @@ static void recieveData(uint8_t* seqNum, uint8_t* buffer)
                 break;
 
             case ST_GET_CHECK:
+                perfCount(PERF_FRAMES);
                 if ( c == checksum ) {
                     msgParseState   = ST_PROCESS;
                 }
                 else {
+                    perfCount(PERF_CHECKSUM_ERRORS);
+#ifdef ENABLE_CHECKSUM_NACK
+                    buffer[0]       = ANSWER_CKSUM_ERROR;   // answered at once, the host does not have to time out
+                    msgParseState   = ST_PROCESS;
+#else
+                    msgParseState   = ST_START;
+#endif
+#ifdef ENABLE_STREAMING_PROGRAM
+                    boot_rww_enable();                  // throw away the page buffer
+#endif
+                }
+#ifdef ENABLE_RS485
+                // frames for other nodes are dropped, a damaged group frame is not answered either
+                if ( ( frameNode != rs485Node ) && ( ( c != checksum ) || ( ( frameNode != rs485Group ) && ( frameNode != RS485_BROADCAST ) ) ) ) {
                     msgParseState   = ST_START;
                 }
+#endif
                 break;
         }       //      switch
     }       //      while(msgParseState)
 	while ( msgParseState != ST_PROCESS );
+	traceEnd(TRACE_RECEIVE);
+}
+
+#ifdef ENABLE_BAUD_SWITCH
+/*
+ * Switch the USART to one of the PARAM_BAUD_RATE baudrates
+ */
+static void setBaudRate(uint8_t index)
+{
+	uint8_t	ubrr;
+	uint8_t	doubleSpeed;
+
+	if (index == 1) {
+		ubrr				=	BAUD_UBRR(BAUD_RATE_1);
+		doubleSpeed	=	BAUD_DOUBLE(BAUD_RATE_1);
+	}
+	else if (index == 2) {
+		ubrr				=	BAUD_UBRR(BAUD_RATE_2);
+		doubleSpeed	=	BAUD_DOUBLE(BAUD_RATE_2);
+	}
+	else if (index == 3) {
+		ubrr				=	BAUD_UBRR(BAUD_RATE_3);
+		doubleSpeed	=	BAUD_DOUBLE(BAUD_RATE_3);
+	}
+	else if (index == 4) {
+		ubrr				=	BAUD_UBRR(BAUD_RATE_4);
+		doubleSpeed	=	BAUD_DOUBLE(BAUD_RATE_4);
+	}
+	else {
+		ubrr				=	UART_BAUD_SELECT( BAUDRATE, F_CPU );
+		doubleSpeed	=	UART_BAUDRATE_DOUBLE_SPEED;
+	}
+
+	UART_STATUS_REG			=	doubleSpeed ? ( 1 << UART_DOUBLE_SPEED ) : 0;
+	UART_BAUD_RATE_LOW	=	ubrr;
+}
+#endif
+
+#ifdef ENABLE_AUTOBAUD
+/*
+ * wait for RXD to reach level, fails once timer 1 overflows
+ */
+static uint8_t waitRxd(uint8_t level)
+{
+
+	while ( ( UART_RX_PIN & ( 1 << UART_RX_BIT ) ) != level ) {
+		if (TIFR1 & ( 1 << TOV1 )) {
+			return 0;
+		}
+	}
+	return 1;
+
+}
+
+/*
+ * Time the MESSAGE_START (0x1B) whose start bit has just begun. Sent LSB first the line is
+ * low for the start bit, high for bits 0-1, low for bit 2, high for bits 3-4 and low for bits 5-7,
+ * so the rising edges after the start bit and after bit 7 are 8 bit times apart. Returns the
+ * double speed UBRR, or -1 if the frame did not look right. Timer 1 is left running for main().
+ */
+static int16_t measureBaudRate(void)
+{
+	uint16_t	start;
+	uint16_t	cycles;
+
+	TCNT1		=	0;
+	TIFR1		=	( 1 << TOV1 );
+	TCCR1B	=	( 1 << CS10 );		// count F_CPU
+
+	if ( !waitRxd( 1 << UART_RX_BIT ) ) {
+		return -1;
+	}
+	start	=	TCNT1;
+
+	if ( !( waitRxd(0) && waitRxd( 1 << UART_RX_BIT ) && waitRxd(0) && waitRxd( 1 << UART_RX_BIT ) ) ) {
+		return -1;
+	}
+	cycles	=	TCNT1 - start;
+
+	// UBRR = F_CPU / ( 8 * baudrate ) - 1, with 8 bit times measured that is cycles / 64 - 1
+	if ( ( cycles < 64 ) || ( cycles >= ( 256U * 64U ) ) ) {
+		return -1;
+	}
+	return ( ( cycles + 32 ) >> 6 ) - 1;
+}
+#endif
+
+#ifdef ENABLE_BOOT_POLICY
+/*
+ * Apply the boot policy of the reset cause, returns the boot window to wait for the host
+ */
+static uint16_t bootWindow(uint8_t resetSource)
+{
+	uint8_t	policy;
+
+	if (resetSource & ( 1 << PORF )) {
+		policy	=	BOOT_POLICY_POWER_ON;
+	}
+	else if (resetSource & ( 1 << EXTRF )) {
+		policy	=	BOOT_POLICY_EXTERNAL;
+	}
+	else if (resetSource & ( 1 << BORF )) {
+		policy	=	BOOT_POLICY_BROWN_OUT;
+	}
+	else if (resetSource & ( 1 << WDRF )) {
+		policy	=	BOOT_POLICY_WATCHDOG;
+	}
+#ifdef JTRF
+	else if (resetSource & ( 1 << JTRF )) {
+		policy	=	BOOT_POLICY_JTAG;
+	}
+#endif
+	else {
+		policy	=	BOOT_FULL;
+	}
+
+	if (policy == BOOT_APP) {
+		appStart();						// only returns if there is no application
+	}
+	else if (policy == BOOT_SHORT) {
+		return BOOT_TIMEOUT_SHORT_MS;
+	}
+	return BOOT_TIMEOUT_MS;
 }
+#endif
 
 void appStart( void )
 {
@@ -402,18 +2217,70 @@ int main(void)
 {
 
 	uint8_t *p;
-	uint8_t	msgBuffer[285];
+	uint8_t	msgBuffer[MSG_BUFFER_SIZE];
   uint8_t	seqNum				= 0;
 	uint8_t ispProgram		= 0;
+	uint8_t parseState		= ST_START;
+#ifdef ENABLE_BAUD_SWITCH
+	uint8_t baudRequest		= BAUD_NONE;
+#endif
 	uint8_t	checksum			= 0;
 	uint16_t msgLength		= 0;
 	uint32_t address			= 0;
 	uint32_t eraseAddress	= 0;
-	uint32_t bootTimer		= 0;
+#ifdef ENABLE_STREAMING_READ
+	uint16_t readSize			= 0;
+#endif
+	uint16_t bootTimer		= 0;
+	uint16_t bootTimeout	= BOOT_TIMEOUT_MS;
+	uint8_t bootForced		= 0;
 	uint8_t resetSource		= MCUSR;
 
 	asm volatile ("clr __zero_reg__");
 
+#ifdef ENABLE_DOUBLE_BUFFER
+	pageState		=	PAGE_IDLE;
+	pageStatus	=	STATUS_CMD_OK;
+#endif
+#ifdef ENABLE_PAGE_COMPARE
+	skippedPages	=	0;
+#endif
+#ifdef ENABLE_CHIP_ERASE
+	eraseAhead		=	APP_END;
+	eraseClean		=	APP_END;
+#endif
+#ifdef RX_RING
+	rxHead				=	0;
+	rxTail				=	0;
+#endif
+#ifdef ENABLE_WINDOWED_PROGRAM
+	windowSize		=	0;
+	windowSeq			=	0;
+	windowPending	=	0;
+#endif
+#ifdef ENABLE_EEPROM
+	eepromHead		=	0;
+	eepromTail		=	0;
+	eepromAddress	=	0;
+#endif
+#ifdef ENABLE_PERF_COUNTERS
+	for (uint8_t counter = 0; counter < PERF_COUNTERS; counter++) {
+		perfCounters[counter]	=	0;
+	}
+#endif
+#ifdef ENABLE_RS485
+	EEAR				=	RS485_NODE_EEPROM;
+	EECR				|=	( 1 << EERE );
+	rs485Node		=	EEDR;
+	if (rs485Node == RS485_BROADCAST) {
+		rs485Node	=	RS485_NODE;
+	}
+	EEAR				=	RS485_GROUP_EEPROM;
+	EECR				|=	( 1 << EERE );
+	rs485Group	=	EEDR;
+	frameNode		=	RS485_BROADCAST;
+#endif
+
 #ifndef REMOVE_WATCHDOG_SUPPORT
 
 	__asm__ __volatile__ ("cli");
@@ -429,14 +2296,98 @@ int main(void)
 #else
 
 	MCUSR		=	0;
+#ifdef ENABLE_BOOT_REQUEST
+	// the application reset through the watchdog, left running it would reset again while waiting for the host
+	if (BOOT_REQUEST_FLAG) {
+		__asm__ __volatile__ ("cli");
+		__asm__ __volatile__ ("wdr");
+		WDTCSR	|=	( 1 << WDCE ) | ( 1 << WDE );
+		WDTCSR	=	0;
+	}
+#endif
+
+#endif
+
+#ifdef ENABLE_STAGED_UPDATE
+	installStaged();
+#endif
+
+#ifdef ENABLE_BOOT_REQUEST
+	// the application asked for the bootloader, wait for the host without a timeout
+	bootForced			=	BOOT_REQUEST_FLAG;
+	BOOT_REQUEST_FLAG	=	0;
+#endif
+
+#ifdef ENABLE_IMAGE_CHECK
+	// a damaged application is never started, wait for the host to replace it
+	if (checkImage() != STATUS_CMD_OK) {
+		bootForced	=	1;
+	}
+#endif
 
+#ifdef ENABLE_BOOT_POLICY
+#ifdef BOOT_STRAP_BIT
+	// sample the strap pin with its pull-up on, pulled low it forces the bootloader
+	BOOT_STRAP_PORT	|=	( 1 << BOOT_STRAP_BIT );
+	for (uint8_t settle = 0; settle < 100; settle++) {
+		asm volatile ("nop");
+	}
+	if (!( BOOT_STRAP_PIN & ( 1 << BOOT_STRAP_BIT ) )) {
+		bootForced	=	1;
+	}
+	BOOT_STRAP_PORT	&=	~( 1 << BOOT_STRAP_BIT );
 #endif
 
+	if (!bootForced) {
+		bootTimeout	=	bootWindow(resetSource);
+	}
+#else
 	// check if WDT generated the reset, if so, go straight to app
-	if ( resetSource & ( 1 << WDRF ) ) {
+	if ( ( resetSource & ( 1 << WDRF ) ) && !bootForced ) {
 		appStart();
 	}
+#endif
+
+#ifdef ENABLE_TRACE_PINS
+	// only once the bootloader stays, an application started above finds the pins as the reset left them
+	TRACE_DDR		|=	TRACE_MASK;
+#endif
+#ifdef ENABLE_RS485
+	RS485_DE_DDR	|=	( 1 << RS485_DE_BIT );		// DE low, the transceiver listens
+#endif
+#ifdef ENABLE_FLOW_CONTROL
+	FLOW_RTS_DDR	|=	( 1 << FLOW_RTS_BIT );		// RTS low, ready to receive
+#endif
+
+#ifdef ENABLE_AUTOBAUD
+	/*
+	 * Keep the USART off and wait for the start bit of the first MESSAGE_START on RXD,
+	 * the USART is only enabled during its stop bit, at the measured baudrate
+	 */
+	int16_t	baudSelect	=	-1;
+
+	timerStart();
+	while ( ( UART_RX_PIN & ( 1 << UART_RX_BIT ) ) && ( bootForced || ( bootTimer != bootTimeout ) ) ) {
+		bootTimer	+=	timerTick();
+	}
+	timerStop();
+	if ( bootForced || ( bootTimer != bootTimeout ) ) {
+		baudSelect	=	measureBaudRate();
+	}
+	if (baudSelect < 0) {
+		baudSelect	=	UART_BAUD_SELECT( BAUDRATE, F_CPU );		// nothing usable, the first message is lost
+	}
+	else {
+		parseState	=	ST_AFTER_START;
+	}
+	UART_STATUS_REG			|=	( 1 << UART_DOUBLE_SPEED );
+	UART_BAUD_RATE_LOW	=	baudSelect;
+	UART_CONTROL_REG		=	( 1 << UART_ENABLE_RECEIVER ) | ( 1 << UART_ENABLE_TRANSMITTER );
 
+	TCCR1B	=	0;
+	TCNT1		=	0;
+	TIFR1		=	( 1 << TOV1 );
+#else
 	/*
 	 * Init UART
 	 * set baudrate and enable USART receiver and transmiter without interrupts
@@ -450,15 +2401,37 @@ int main(void)
 	asm volatile ("nop");			// wait until port has changed
 
 	// wait for data
-	while ( (!( serialAvailable() )) && ( ++bootTimer != BOOT_TIMEOUT ) ) {
-		asm volatile ("nop");
+	timerStart();
+	while ( (!( serialAvailable() )) && ( bootForced || ( bootTimer != bootTimeout ) ) ) {
+		bootTimer	+=	timerTick();
 	}
+	timerStop();
+#endif
 
-	if (bootTimer != BOOT_TIMEOUT) {
+	if ( bootForced || ( bootTimer != bootTimeout ) ) {
+#ifdef ENABLE_PERF_COUNTERS
+		TCNT1		=	0;
+		TCCR1B	=	PERF_TIMER_PRESCALER;
+#endif
 		//	main loop
 		while ( ispProgram == 0 ) {
-			recieveData(&seqNum, msgBuffer);	// Retrieve all the data
+			recieveData(&seqNum, msgBuffer, &address, parseState);	// Retrieve all the data
+			parseState	=	ST_START;
+#ifdef ENABLE_WINDOWED_PROGRAM
+			// any other message answers straight away and sets the sequence number the window goes on from, a damaged one leaves it
+			if ( ( windowSize == 0 ) || ( ( msgBuffer[0] != CMD_PROGRAM_FLASH_ISP ) && ( msgBuffer[0] != ANSWER_CKSUM_ERROR ) ) ) {
+				windowSeq			=	seqNum + 1;
+				windowPending	=	0;
+			}
+#endif
 			// Now process the STK500 commands, see Atmel Appnote AVR068
+#ifdef ENABLE_CHECKSUM_NACK
+			if(msgBuffer[0] == ANSWER_CKSUM_ERROR) {
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CKSUM_ERROR;
+			}
+			else
+#endif
 			if(msgBuffer[0] == CMD_SIGN_ON) {
 					msgLength		= 11;
 					msgBuffer[1] 	= STATUS_CMD_OK;
@@ -472,6 +2445,11 @@ int main(void)
 					msgBuffer[9] 	= '_';
 					msgBuffer[10]	= '2';
 			}
+#ifdef ENABLE_SESSION_INFO
+			else if(msgBuffer[0] == CMD_SESSION_INFO) {
+					msgLength		= sessionInfo(msgBuffer + 1) - msgBuffer;
+			}
+#endif
 			else if(msgBuffer[0] == CMD_GET_PARAMETER) {
 					uint8_t value;
 					value					= getParameter(msgBuffer[1]);
@@ -479,12 +2457,79 @@ int main(void)
 					msgBuffer[1]	= STATUS_CMD_OK;
 					msgBuffer[2]	= value;
 			}
+#ifdef ENABLE_BAUD_SWITCH
+			else if( ( msgBuffer[0] == CMD_SET_PARAMETER ) && ( msgBuffer[1] == PARAM_BAUD_RATE ) ) {
+					// the new baudrate is only set once this answer has gone out
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CMD_FAILED;
+					if ( ( msgBuffer[2] < 5 ) && ( BAUD_RATES_SUPPORTED & ( 1 << msgBuffer[2] ) ) ) {
+							baudRequest		= msgBuffer[2];
+							msgBuffer[1]	= STATUS_CMD_OK;
+					}
+			}
+#endif
+#ifdef ENABLE_PERF_COUNTERS
+			else if( ( msgBuffer[0] == CMD_SET_PARAMETER ) && ( msgBuffer[1] == PARAM_PERF_COUNTERS ) ) {
+					// any value clears all counters
+					for (uint8_t counter = 0; counter < PERF_COUNTERS; counter++) {
+							perfCounters[counter]	= 0;
+					}
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CMD_OK;
+			}
+#endif
+#ifdef ENABLE_WINDOWED_PROGRAM
+			else if( ( msgBuffer[0] == CMD_SET_PARAMETER ) && ( msgBuffer[1] == PARAM_WINDOW_SIZE ) ) {
+					// cut to what the receive ring can hold, the host reads back what it got
+					windowSize		= ( msgBuffer[2] < WINDOW_MAX ) ? msgBuffer[2] : WINDOW_MAX;
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CMD_OK;
+			}
+			else if( ( msgBuffer[0] == CMD_PROGRAM_FLASH_ISP ) && windowSize ) {
+					// go back N, a frame out of sequence follows a lost one and is dropped
+					uint16_t size	= ((msgBuffer[1]) << 8) | msgBuffer[2];
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CMD_OK;
+					if (seqNum == windowSeq) {
+							msgBuffer[1]	= programBlock(&address, &eraseAddress, size, msgBuffer + 10);
+							windowSeq++;
+							windowPending++;
+					}
+#ifdef ENABLE_STREAMING_PROGRAM
+					else {
+							boot_rww_enable();			// throw away the page buffer
+					}
+#endif
+					// one answer for all frames up to the last one programmed, sent once the window is full or the host has stopped sending
+					seqNum	=	windowSeq - 1;
+					if ( ( msgBuffer[1] == STATUS_CMD_OK ) && ( windowPending < windowSize ) && serialAvailable() ) {
+							continue;
+					}
+					windowPending	=	0;
+			}
+#endif
 			else if( ( msgBuffer[0] == CMD_LEAVE_PROGMODE_ISP ) || ( msgBuffer[0] == CMD_SET_PARAMETER ) || ( msgBuffer[0] == CMD_ENTER_PROGMODE_ISP ) ) {
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CMD_OK;
+#if defined(ENABLE_STREAMING_PROGRAM) && defined(ENABLE_IMAGE_CHECK)
+					if(msgBuffer[0] == CMD_ENTER_PROGMODE_ISP) {
+							imageTouched();			// an EEPROM write would clear the page buffer the next frame is streamed into
+					}
+#endif
 					if(msgBuffer[0] == CMD_LEAVE_PROGMODE_ISP) {
 							ispProgram	= 1;
+							completeEeprom();
+							completePage();			// the trailer may be in the last page written
+#ifdef ENABLE_DOUBLE_BUFFER
+							msgBuffer[1]	= pageStatus;
+#endif
+#ifdef ENABLE_IMAGE_CHECK
+							if ( trailerStale() || ( checkImage() != STATUS_CMD_OK ) ) {
+									ispProgram		= 0;		// stay for another upload
+									msgBuffer[1]	= STATUS_CMD_FAILED;
+							}
+#endif
 					}
-					msgLength			= 2;
-					msgBuffer[1]	= STATUS_CMD_OK;
 			}
 			else if(msgBuffer[0] == CMD_LOAD_ADDRESS) {
 #if defined(RAMPZ)
@@ -498,16 +2543,94 @@ int main(void)
 			}
 			else if(msgBuffer[0] == CMD_PROGRAM_FLASH_ISP) {
 					uint16_t size	= ((msgBuffer[1]) << 8) | msgBuffer[2];
-					programDevice(&address, &eraseAddress, size, msgBuffer + 10);
+					msgBuffer[1]	= programBlock(&address, &eraseAddress, size, msgBuffer + 10);
 					msgLength		= 2;
-					msgBuffer[1]	= STATUS_CMD_OK;
 			}
 			else if(msgBuffer[0] == CMD_READ_FLASH_ISP) {
 				uint16_t size	= ((msgBuffer[1])<<8) | msgBuffer[2];
-				uint8_t	*p		= msgBuffer + 1;
 				msgLength		= size + 3;
+#ifdef ENABLE_STREAMING_READ
+				// the flash data is sent between msgBuffer[1] and msgBuffer[2] by the transmit loop
+				completePage();
+				eraseUpTo(address + size - 1);	// pages the background chip erase has not reached still hold the old code
+				traceBegin(TRACE_READ);		// overlaps TRACE_TRANSMIT, the bytes are read as they go out
+				readSize		= size;
+				msgBuffer[1]	= STATUS_CMD_OK;
+				msgBuffer[2]	= STATUS_CMD_OK;
+#else
+				uint8_t	*p		= msgBuffer + 1;
+				eraseUpTo(address + size - 1);	// pages the background chip erase has not reached still hold the old code
 				readDevice(&address, size, p);
+#endif
+			}
+
+#ifdef ENABLE_EEPROM
+			else if(msgBuffer[0] == CMD_PROGRAM_EEPROM_ISP) {
+					uint16_t size	= ((msgBuffer[1]) << 8) | msgBuffer[2];
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CMD_FAILED;
+					if ( size <= ( MSG_BUFFER_SIZE - 10 ) ) {
+							programEeprom(&address, size, msgBuffer + 10);
+							msgBuffer[1]	= STATUS_CMD_OK;
+					}
+			}
+			else if(msgBuffer[0] == CMD_READ_EEPROM_ISP) {
+					uint16_t size	= ((msgBuffer[1]) << 8) | msgBuffer[2];
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CMD_FAILED;
+					if ( size <= ( MSG_BUFFER_SIZE - 3 ) ) {
+							msgLength		= size + 3;
+							readEeprom(&address, size, msgBuffer + 1);
+					}
+			}
+#endif
+
+#ifdef ENABLE_COMPRESSED_PROGRAM
+			else if(msgBuffer[0] == CMD_PROGRAM_FLASH_LZ) {
+					// inflated size and stream size follow MSB first, then the stream
+					uint16_t size		= ((msgBuffer[1]) << 8) | msgBuffer[2];
+					uint16_t stream	= ((msgBuffer[3]) << 8) | msgBuffer[4];
+					msgBuffer[1]		= STATUS_CMD_FAILED;
+					if ( stream <= ( MSG_BUFFER_SIZE - 5 ) ) {
+							msgBuffer[1]	= programCompressed(&address, &eraseAddress, size, msgBuffer + 5, stream);
+					}
+					msgLength				= 2;
 			}
+#endif
+
+#ifdef ENABLE_FLASH_CRC
+			else if(msgBuffer[0] == CMD_CRC_FLASH) {
+					// byte count follows MSB first, the range starts at the loaded address which is left as it is
+					uint32_t length	= ((uint32_t)(msgBuffer[1]) << 24) | ((uint32_t)(msgBuffer[2]) << 16) | ((uint32_t)(msgBuffer[3]) << 8) | msgBuffer[4];
+					uint16_t crc;
+					completePage();
+					eraseUpTo(address + length - 1);
+					crc							= crcFlash(address, length);
+					msgLength				= 4;
+					msgBuffer[1]		= STATUS_CMD_OK;
+					msgBuffer[2]		= (uint8_t)(crc >> 8);
+					msgBuffer[3]		= (uint8_t)crc;
+			}
+			else if(msgBuffer[0] == CMD_CRC_PAGES) {
+					// one CRC per SPM_PAGESIZE page from the loaded address on, the count is cut to what fits the answer
+					uint32_t pageAddress	= address;
+					uint8_t pages					= msgBuffer[1];
+					uint8_t *crcData			= msgBuffer + 2;
+					if ( pages > CRC_PAGES_MAX ) {
+							pages	=	CRC_PAGES_MAX;
+					}
+					completePage();
+					eraseUpTo(address + ((uint32_t)pages * SPM_PAGESIZE) - 1);
+					msgLength				= 2 + ( pages << 1 );
+					msgBuffer[1]		= STATUS_CMD_OK;
+					while ( pages-- ) {
+							uint16_t crc	=	crcFlash(pageAddress, SPM_PAGESIZE);
+							*crcData++		=	(uint8_t)(crc >> 8);
+							*crcData++		=	(uint8_t)crc;
+							pageAddress		+=	SPM_PAGESIZE;
+					}
+			}
+#endif
 
 #ifndef REMOVE_READ_SIGNATURE_SUPPORT
 			else if(msgBuffer[0] == CMD_READ_SIGNATURE_ISP) {
@@ -528,6 +2651,7 @@ int main(void)
 
 #ifndef REMOVE_PROGRAM_LOCK_BIT_SUPPORT
 			else if(msgBuffer[0] == CMD_READ_LOCK_ISP) {
+					completePage();
 					msgLength		= 4;
 					msgBuffer[1]	= STATUS_CMD_OK;
 					msgBuffer[2]	= boot_lock_fuse_bits_get( GET_LOCK_BITS );
@@ -538,6 +2662,7 @@ int main(void)
 #ifndef REMOVE_READ_FUSE_BIT_SUPPORT
 			else if(msgBuffer[0] == CMD_READ_FUSE_ISP) {
 					uint8_t fuseBits;
+					completePage();
 					if ( msgBuffer[2] == 0x50 ) {
 							if ( msgBuffer[3] == 0x08 ) {
 									fuseBits	=	boot_lock_fuse_bits_get( GET_EXTENDED_FUSE_BITS );
@@ -561,6 +2686,7 @@ int main(void)
 					uint8_t answerByte;
 					uint8_t flag=0;
 
+					completePage();				// the fuses can not be read while a page is being written
 					if ( msgBuffer[4]== 0x30 ) {
 							uint8_t signatureIndex	=	msgBuffer[6];
 
@@ -600,17 +2726,39 @@ int main(void)
 			}
 #endif
 
+#ifdef ENABLE_CHIP_ERASE
+			else if(msgBuffer[0] == CMD_CHIP_ERASE_ISP) {
+					// the pages are erased in the background, programDevice() only erases what has not been reached
+					completeEeprom();
+					completePage();
+					imageTouched();
+					eraseAhead		= 0;
+					eraseClean		= 0;
+					msgLength			= 2;
+					msgBuffer[1]	= STATUS_CMD_OK;
+			}
+#endif
+
 			else {
-				if(msgBuffer[0] == CMD_CHIP_ERASE_ISP) {
-					eraseAddress	= 0;
-				}
 				msgLength			= 2;
 				msgBuffer[1]	= STATUS_CMD_FAILED;
 			}
 
+#ifdef ENABLE_RS485
+			if (frameNode != rs485Node) {
+				continue;					// every node of the group would answer at once
+			}
+			UART_CONTROL_REG	&=	~( 1 << UART_ENABLE_RECEIVER );		// the transceiver may echo the answer
+			RS485_DE_PORT			|=	( 1 << RS485_DE_BIT );
+#endif
 			// Now send answer message back
+			traceBegin(TRACE_TRANSMIT);
 			transmitChar(MESSAGE_START);
 			checksum	=	MESSAGE_START ^ 0;
+#ifdef ENABLE_RS485
+			transmitChar(rs485Node);
+			checksum	^=	rs485Node;
+#endif
 
 			transmitChar(seqNum);
 			checksum	^=	seqNum;
@@ -628,19 +2776,84 @@ int main(void)
 
 			p	=	msgBuffer;
 			while ( msgLength ) {
+#ifdef ENABLE_STREAMING_READ
+				if ( ( p == msgBuffer + 2 ) && readSize ) {
+					c	=	readFlashByte(address);
+					address++;
+					readSize--;
+				}
+				else
+#endif
 				c	=	*p++;
 				transmitChar(c);
 				checksum ^= c;
 				msgLength--;
 			}
+#ifdef ENABLE_STREAMING_READ
+			traceEnd(TRACE_READ);
+#endif
 
 			transmitChar(checksum);
+			traceEnd(TRACE_TRANSMIT);
+#ifdef ENABLE_RS485
+			transmitFlush();
+			RS485_DE_PORT			&=	~( 1 << RS485_DE_BIT );
+			UART_CONTROL_REG	|=	( 1 << UART_ENABLE_RECEIVER );
+#endif
+
+#ifdef ENABLE_BAUD_SWITCH
+			if (baudRequest != BAUD_NONE) {
+				uint8_t		timeout		=	0;
+				uint8_t		oldStatus	=	UART_STATUS_REG & ( 1 << UART_DOUBLE_SPEED );
+				uint8_t		oldRate		=	UART_BAUD_RATE_LOW;
+
+				transmitFlush();
+				setBaudRate(baudRequest);
+				baudRequest	=	BAUD_NONE;
+
+				// the host confirms the new baudrate with its next message, go back to the old one if no clean MESSAGE_START turns up
+				timerStart();
+				// the USART is checked directly, the frame error flag belongs to the byte still in UDR
+				while ( (!( UART_STATUS_REG & ( 1 << UART_RECEIVE_COMPLETE ) )) && ( timeout != BAUD_CONFIRM_TIMEOUT_MS ) ) {
+					timeout	+=	timerTick();
+				}
+				timerStop();
+				if ( ( timeout != BAUD_CONFIRM_TIMEOUT_MS ) && !( UART_STATUS_REG & ( 1 << UART_FRAME_ERROR ) ) && ( UART_DATA_REG == MESSAGE_START ) ) {
+					parseState	=	ST_AFTER_START;
+				}
+				else {
+					UART_STATUS_REG			=	oldStatus;
+					UART_BAUD_RATE_LOW	=	oldRate;
+					while ( UART_STATUS_REG & ( 1 << UART_RECEIVE_COMPLETE ) ) {
+						(void)UART_DATA_REG;
+					}
+				}
+			}
+#endif
 		}
+		transmitFlush();			// let the last answer leave before the USART is reset
+#ifdef ENABLE_CHIP_ERASE
+		eraseUpTo(APP_END - 1);		// finish the chip erase before the application starts, the host has its answer already
+#endif
+#ifdef ENABLE_PERF_COUNTERS
+		TCCR1B	=	0;				// timer 1 back into its reset state for the application
+		TCNT1		=	0;
+#endif
 	}
 
 	asm volatile ("nop");			// wait until port has changed
 
 	//Now leave bootloader
+#ifdef ENABLE_TRACE_PINS
+	TRACE_DDR		&=	~TRACE_MASK;
+#endif
+#ifdef ENABLE_RS485
+	RS485_DE_DDR	&=	~( 1 << RS485_DE_BIT );
+#endif
+#ifdef ENABLE_FLOW_CONTROL
+	FLOW_RTS_DDR	&=	~( 1 << FLOW_RTS_BIT );
+	FLOW_RTS_PORT	&=	~( 1 << FLOW_RTS_BIT );
+#endif
 	UART_STATUS_REG	&=	0xFD;
 	boot_rww_enable();				// enable application section
 